@@ -0,0 +1,22 @@
+; ALU chain: dependent ADD/SUB/MUL/EOR on twelve registers behind an always-taken back edge
+        MOVI R1, 3
+        MOVI R2, 5
+        MOVI R3, 7
+        MOVI R4, 1
+loop:   ADD R1, R2
+        SUB R2, R3
+        MUL R3, R4
+        EOR R4, R1
+        ADD R5, R1
+        SUB R6, R2
+        MUL R7, R3
+        EOR R8, R4
+        ADD R9, R5
+        SUB R10, R6
+        MUL R11, R7
+        EOR R12, R8
+        ADD R13, R9
+        SUB R14, R10
+        MUL R13, R11
+        EOR R14, R12
+        BEQZ R0, loop
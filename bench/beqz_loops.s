@@ -0,0 +1,14 @@
+; Nested countdown loops: data-dependent BEQZ exits plus always-taken back edges
+        MOVI R15, -1
+restart:
+        MOVI R1, 31
+        MOVI R2, 31
+inner:  ADD R3, R2
+        EOR R4, R3
+        ADD R2, R15
+        BEQZ R2, outer
+        BEQZ R0, inner
+outer:  ADD R1, R15
+        BEQZ R1, restart
+        MOVI R2, 31
+        BEQZ R0, inner
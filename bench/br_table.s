@@ -0,0 +1,26 @@
+; Jump table: BR R1, R0 jumps to instruction 4 * R1 - 1, so the four cases sit at 3, 7, 11 and 15.
+; Each case works on its own registers and steps R1 down; dispatch wraps it back to 4.
+        MOVI R15, -1
+        MOVI R1, 4
+        BEQZ R0, dispatch
+case1:  ADD R2, R1
+        EOR R3, R2
+        ADD R1, R15
+        BEQZ R0, dispatch
+case2:  SUB R4, R1
+        MUL R5, R4
+        ADD R1, R15
+        BEQZ R0, dispatch
+case3:  SAL R6, 1
+        EOR R6, R1
+        ADD R1, R15
+        BEQZ R0, dispatch
+case4:  LDR R7, 9
+        ADD R7, R1
+        STR R7, 9
+        ADD R1, R15
+dispatch:
+        BEQZ R1, reset
+        BR R1, R0
+reset:  MOVI R1, 4
+        BR R1, R0
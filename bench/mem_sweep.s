@@ -0,0 +1,29 @@
+; Memory sweep: copies bytes 0-7 to 32-39 and rotates 32-35 back into 0-3, bumping one value per pass
+.data 0, 1, 2, 3, 4, 5, 6, 7, 8
+        MOVI R15, 1
+loop:   LDR R1, 0
+        LDR R2, 1
+        LDR R3, 2
+        LDR R4, 3
+        ADD R1, R15
+        STR R1, 32
+        STR R2, 33
+        STR R3, 34
+        STR R4, 35
+        LDR R5, 4
+        LDR R6, 5
+        LDR R7, 6
+        LDR R8, 7
+        STR R5, 36
+        STR R6, 37
+        STR R7, 38
+        STR R8, 39
+        LDR R9, 32
+        LDR R10, 33
+        LDR R11, 34
+        LDR R12, 35
+        STR R9, 1
+        STR R10, 2
+        STR R11, 3
+        STR R12, 0
+        BEQZ R0, loop
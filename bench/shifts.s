@@ -0,0 +1,25 @@
+; Shift-heavy code: SAL/SAR pairs with small counts, reseeded through EOR so the values never settle
+        MOVI R1, 1
+        MOVI R2, -3
+        MOVI R3, 27
+        MOVI R4, 13
+loop:   SAL R1, 1
+        SAR R2, 1
+        SAL R3, 3
+        SAR R3, 2
+        EOR R1, R3
+        SAL R4, 2
+        SAR R4, 1
+        EOR R2, R4
+        SAL R5, 4
+        EOR R5, R1
+        SAR R5, 3
+        SAL R6, 5
+        EOR R6, R2
+        SAR R6, 2
+        SAL R7, 1
+        EOR R7, R5
+        SAR R7, 1
+        EOR R3, R6
+        EOR R4, R7
+        BEQZ R0, loop
@@ -1,12 +1,43 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef _WIN32
+#include <windows.h>
+#define PSAPI_VERSION 2 // GetProcessMemoryInfo from kernel32, no psapi.lib needed
+#include <psapi.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "sim.h"
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_RDTSC 1 // --profile ticks are TSC cycles, nanoseconds elsewhere
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
 // Define constants
 #define INSTRUCTION_MEMORY_SIZE 1024 // 16-bit words
 #define DATA_MEMORY_SIZE 2048        // 8-bit bytes
 #define REGISTER_COUNT 66
+#define DATA_DIRTY_LINE 64           // Bytes of data memory per bit of CPU.dirty_data_lines
 
 // Define flags in the status register
 #define CARRY_FLAG 0x01
@@ -15,22 +46,183 @@
 #define SIGN_FLAG 0x08
 #define ZERO_FLAG 0x10
 
-int reg_used[REGISTER_COUNT] = {0}; // Initialize all elements to 0
+// Output verbosity levels (selected with --log)
+#define LOG_SILENT 0  // No simulator output
+#define LOG_SUMMARY 1 // Only the End_program report
+#define LOG_DELTA 2   // Per-cycle stage trace with only the registers and memory bytes that changed
+#define LOG_FULL 3    // Per-cycle stage trace with a full print_cpu_state dump
 
-// Define structures for the pipeline stages
-typedef struct {
-    bool active;
-} PipelineStage;
+#define LOG(cpu, level, ...) do { if ((cpu)->log_level >= (level)) printf(__VA_ARGS__); } while (0)
+
+// Library builds (-DCA_SIM_LIBRARY) have no main() and call the sim.h hooks; the command-line
+// simulator compiles the hook sites away
+#ifdef CA_SIM_LIBRARY
+#define SIM_HOOK(cpu, hook, ...) do { if ((cpu)->hooks.hook) (cpu)->hooks.hook((cpu)->hooks.context, (cpu), __VA_ARGS__); } while (0)
+#else
+#define SIM_HOOK(cpu, hook, ...) do { } while (0)
+#endif
+
+#define OUTPUT_BUFFER_SIZE (1 << 20) // stdout is fully buffered through one large block
+
+#define DEFAULT_MAX_CYCLES 1000000 // Cycle budget per run unless --max-cycles overrides it (0 = unlimited)
+
+#define HALT_OPCODE 0x0F
+
+#define MAX_PATH_LENGTH 256
+
+// Binary program image written by --assemble. All integers are little-endian:
+//   header: "CAIM", u16 version, u16 instruction count, u16 data memory size, u16 symbol count, u32 reserved
+//   then the instruction words (u16 each), the initial data memory and the symbol records
+//   (u32 instruction index followed by a NUL-padded name)
+#define IMAGE_MAGIC "CAIM"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 16
+#define SYMBOL_NAME_LENGTH 28
+#define IMAGE_SYMBOL_SIZE (4 + SYMBOL_NAME_LENGTH)
+
+// Front-end branch prediction, selected with --predictor. BEQZ targets are PC-relative, so fetch
+// computes them from the instruction word; BR targets come from the BTB (--btb entries).
+#define PREDICT_NOT_TAKEN 0 // Static not-taken: every taken BEQZ flushes (the original machine)
+#define PREDICT_BACKWARD 1  // Static backward-taken, forward-not-taken
+#define PREDICT_1BIT 2      // Last outcome of each BEQZ
+#define PREDICT_2BIT 3      // Two-bit saturating counter per BEQZ
+#define PREDICT_GSHARE 4    // Two-bit counters indexed by PC xor global history
+#define GSHARE_HISTORY_BITS 10
+#define BTB_MAX_ENTRIES 64
+
+// Operand forwarding between back-to-back instructions, selected with --forwarding
+#define FORWARD_NONE 0 // Decode reads the register file, so a consumer waits for its producer to leave execute
+#define FORWARD_EX 1   // EX->EX bypass: results reach the next instruction's execute with no interlock
+
+// Differential fuzzing (--fuzz): random programs run on the detailed pipeline, the lockstep engine, the
+// JIT (where supported) and the functional core, which serves as the reference, and must leave the same
+// registers, SREG and data memory
+#define FUZZ_MAX_LENGTH 32       // Instructions per generated program
+#define FUZZ_DATA_BYTES 64       // Initial data: LDR/STR immediates reach bytes 0-63
+#define FUZZ_MAX_STEPS 2000      // Micro-ops the reference may run; longer programs are skipped
+#define FUZZ_CYCLES_PER_STEP 8   // Pipeline cycles per reference micro-op (plus cache latencies) before it counts as hung
+#define FUZZ_MATCH 0
+#define FUZZ_SKIPPED 1           // The reference did not finish within FUZZ_MAX_STEPS
+#define FUZZ_DIVERGED 2
+
+// Stage roles in a pipeline description (--pipeline). The timing model derives where operands
+// are read, where results and branch outcomes appear and where LDR data arrives from them.
+#define STAGE_FETCH 0
+#define STAGE_DECODE 1     // Operands are read from the register file in the last decode stage
+#define STAGE_EXECUTE 2    // ALU results, branch resolution and the fetch redirect
+#define STAGE_MEMORY 3     // LDR/STR access data memory
+#define STAGE_WRITEBACK 4
+#define PIPELINE_MAX_STAGES 7
+#define PIPELINE_MAX_WIDTH 4
+
+// Data cache between execute() and data_memory (--dcache). LDR/STR hold every pipeline stage for
+// the cycles an access takes beyond the first.
+#define DCACHE_MAX_LINES 256
+#define DCACHE_MAX_LINE_SIZE 128
+#define DCACHE_DEFAULT_WAYS 1
+#define DCACHE_DEFAULT_LINE_SIZE 8
+#define DCACHE_DEFAULT_HIT_LATENCY 1
+#define DCACHE_DEFAULT_MISS_LATENCY 10 // Cycles to reach data_memory, paid again for a dirty victim
+
+// Out-of-order core (--mode ooo): reorder buffer and reservation station sizes (--rob, --rs),
+// fetch/dispatch/issue/commit width (--width) and execution latencies in cycles
+#define OOO_MAX_ROB 256
+#define OOO_MAX_RS 128
+#define OOO_DEFAULT_ROB 32
+#define OOO_DEFAULT_RS 16
+#define OOO_DEFAULT_WIDTH 2
+#define OOO_ALU_LATENCY 1
+#define OOO_MUL_LATENCY 3
+#define OOO_LOAD_LATENCY 2
+
+// Basic-block translator (--mode jit), x86-64 hosts with mmap only
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED 1
+#endif
+#define JIT_CODE_SIZE (4 << 20)  // Bytes of translated code per run; when full, the rest is interpreted
+#define JIT_MAX_BLOCK 64         // Micro-ops per translated block
+#define JIT_BLOCK_BYTES (16 * JIT_MAX_BLOCK + 256) // Worst-case native code of one block
+#define JIT_MAX_LINKS 4096       // Chained jumps waiting for their target block to be translated
+
+// Pipeline snapshot written by --checkpoint-every and read by --restore. Little-endian:
+//   header: "CACK", u16 version, u16 instruction count, u64 cycle count, u64 retired count
+//   then R0-R65, the reg_used bitmap, the IFID and IDEX latches, stall_flag, halted, the forwarding network,
+//   the predictor state, the data cache, the event counters (u64 each), the instruction words (u16 each)
+//   and the data memory
+#define CHECKPOINT_MAGIC "CACK"
+#define CHECKPOINT_VERSION 4
+#define CHECKPOINT_HEADER_SIZE 24
+#define PREDICTOR_STATE_SIZE (4 + INSTRUCTION_MEMORY_SIZE + 3 * BTB_MAX_ENTRIES)
+#define DCACHE_STATE_SIZE (24 + 11 * DCACHE_MAX_LINES)
+#define COUNTER_STATE_SIZE (8 * (sizeof(PerfCounters) / sizeof(long)))
+#define CHECKPOINT_STATE_SIZE (REGISTER_COUNT + (REGISTER_COUNT + 7) / 8 + 8 + 11 + 3 + PREDICTOR_STATE_SIZE + \
+                               DCACHE_STATE_SIZE + COUNTER_STATE_SIZE)
+
+// Execution trace written by --trace and read by --trace-read. Little-endian:
+//   header: "CATR", u16 version, u16 instruction count, u64 cycle the run started from,
+//   then the instruction words (u16 each) and the blocks: u32 compressed size, u32 raw size,
+//   u32 record count and the LZ-compressed records
+// A record is one retired instruction: a tag byte (TRACE_*) followed by only the fields that are not
+// implied by the previous record, in tag bit order. Cycle deltas, PCs and addresses are varints.
+#define TRACE_MAGIC "CATR"
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_BLOCK_HEADER_SIZE 12
+#define TRACE_BLOCK_SIZE 65536 // Raw record bytes per block; one block is compressed while the next fills
+#define TRACE_RECORD_MAX 24    // Longest encoded record
+#define TRACE_HASH_BITS 12     // Match finder table size of the block compressor
+#define TRACE_CYCLE_NEXT 0x01  // Retired the cycle after the previous record, otherwise the cycle delta follows
+#define TRACE_PC_NEXT 0x02     // PC follows the previous record's, otherwise the PC follows
+#define TRACE_REG_WRITE 0x04   // u8 register and u8 value follow
+#define TRACE_MEM_WRITE 0x08   // Address and u8 value follow
+#define TRACE_SREG 0x10        // SREG changed, u8 value follows
+#define TRACE_EVENTS 0x20      // u8 TRACE_EVENT_* bits follow
+#define TRACE_EVENT_FLUSH 0x01         // Taken BEQZ flushed the fetched path
+#define TRACE_EVENT_BR_FLUSH 0x02      // BR flushed the fetched path
+#define TRACE_EVENT_CONTROL_STALL 0x04 // Fetch stalled on a BR since the previous record
+#define TRACE_EVENT_DATA_STALL 0x08    // Decode interlocked since the previous record
+#define TRACE_EVENT_MEMORY_STALL 0x10  // The data cache held the pipeline, counted by the LDR/STR that waits
 
+#define BENCH_REPEATS 5             // Each workload/mode pair is timed this often and the fastest run kept
+#define BENCH_DEFAULT_TOLERANCE 20  // Percent slowdown over the baseline before --bench flags a result
+
+// Multi-core runs (--cores): one detailed pipeline per host thread over shared data memory
+#define MULTICORE_MAX_CORES 64
+#define MULTICORE_SHARED_BYTES 64   // LDR/STR immediates reach bytes 0-63
+#define MULTICORE_SPINS 4096        // Barrier polls before a waiting thread starts yielding the host core
+
+// Host profiler (--profile): stages the scoped timers cover
+#define PROFILE_SAMPLE_PERIOD 16 // Stages inside pipeline cycles are timed in one cycle of this many
+#define PROFILE_MAX_NODES 64     // Distinct call paths
+#define PROFILE_MAX_DEPTH 8
+#define PROFILE_CALIBRATION_ROUNDS 1000
+#define PROFILE_MAIN 0
+#define PROFILE_LOAD_PROGRAM 1
+#define PROFILE_RUN 2
+#define PROFILE_FETCH 3
+#define PROFILE_DECODE 4
+#define PROFILE_EXECUTE 5
+#define PROFILE_UPDATE_SREG 6
+#define PROFILE_FLUSH 7
+#define PROFILE_FLUSH_BR 8
+#define PROFILE_PRINT_STATE 9
+#define PROFILE_PRINT_DELTA 10
+#define PROFILE_END_PROGRAM 11
+#define PROFILE_STAGES 12
+
+#define LOCKSTEP_LANES 32 // int8 lanes in one AVX2 register (two SSE registers without AVX2)
+
+// Instruction memory word; the instruction's number is its index + 1
 typedef struct {
     uint16_t current_Instruction;
-    PipelineStage fetch, decode, execute;
-    int inst_number;
 } Instruction;
 
 typedef struct {
     uint16_t instruction;
     int inst_number;
+    bool predicted;       // Fetch followed a predicted-taken BEQZ or a BTB hit for this instruction
+    int8_t predicted_pc;  // Where fetch went next when predicted is set
+    uint16_t history;     // gshare history the prediction was made with, reused to train it
 } IFID;
 
 typedef struct {
@@ -40,24 +232,523 @@ typedef struct {
     int8_t immediate;  // Use int8_t to handle negative values for certain instructions
     int inst_number;
     int isempty; // 1 if the stage is empty and 0 if it is full
+    bool predicted;
+    int8_t predicted_pc;
+    uint16_t history;
 } IDEX;
 
 typedef struct {
+    int16_t pc;     // BR this entry belongs to, -1 when empty
+    int8_t target;  // PC fetched after it
+} BTBEntry;
+
+typedef struct {
+    int kind;                 // PREDICT_*
+    int btb_entries;          // 0 = no BTB: BR stalls fetch in decode until it executes
+    uint16_t history;         // Global BEQZ outcomes for gshare, newest in bit 0
+    uint8_t counters[INSTRUCTION_MEMORY_SIZE];
+    BTBEntry btb[BTB_MAX_ENTRIES];
+} BranchPredictor;
+
+static const char *const predictor_names[] = { "not-taken", "backward", "1bit", "2bit", "gshare" };
+
+typedef struct {
+    uint16_t tag;
+    bool valid;
+    bool dirty;
+    uint64_t last_used; // Access tick of the last hit or fill, for LRU replacement
+} CacheLine;
+
+typedef struct {
+    int size;            // Bytes, 0 = no cache: LDR/STR take a single cycle
+    int ways;
+    int line_size;
+    int sets;
+    bool write_back;     // Write-back with write-allocate, otherwise write-through without allocate
+    int hit_latency;
+    int miss_latency;
+    uint64_t tick;
+    CacheLine lines[DCACHE_MAX_LINES]; // Set-major: set s holds lines[s * ways] to lines[s * ways + ways - 1]
+} DataCache;
+
+typedef struct {
+    const char *name;
+    int role; // STAGE_*
+} StageDescription;
+
+typedef struct {
+    int depth;
+    StageDescription stages[PIPELINE_MAX_STAGES];
+} PipelineDescription;
+
+// Microarchitectures --pipeline can model. The 3-stage entry is the machine run_pipeline()
+// simulates cycle by cycle; the deeper ones give LDR/STR their own MEM and WB stages.
+static const PipelineDescription pipeline_descriptions[] = {
+    { 3, { { "IF", STAGE_FETCH }, { "ID", STAGE_DECODE }, { "EX", STAGE_EXECUTE } } },
+    { 5, { { "IF", STAGE_FETCH }, { "ID", STAGE_DECODE }, { "EX", STAGE_EXECUTE }, { "MEM", STAGE_MEMORY },
+           { "WB", STAGE_WRITEBACK } } },
+    { 7, { { "IF1", STAGE_FETCH }, { "IF2", STAGE_FETCH }, { "ID", STAGE_DECODE }, { "RF", STAGE_DECODE },
+           { "EX", STAGE_EXECUTE }, { "MEM", STAGE_MEMORY }, { "WB", STAGE_WRITEBACK } } },
+};
+
+static const int issue_widths[] = { 1, 2, 4 };
+
+// In-order timing model for one PipelineDescription and issue width. Each instruction is given the
+// cycle it occupies every stage; only the last `width` instructions are needed to place the next.
+typedef struct {
+    const PipelineDescription *pipeline;
+    int width;
+    int read_stage;      // Where operands are read without forwarding
+    int execute_stage;
+    int load_stage;      // First stage LDR data can be forwarded from
+    long recent[PIPELINE_MAX_WIDTH][PIPELINE_MAX_STAGES]; // Stage cycles of the last `width` instructions
+    int oldest;          // Row of recent[] holding the instruction `width` places ahead
+    long previous[PIPELINE_MAX_STAGES];
+    long ready[16];      // First cycle the newest value of each register can be consumed
+    bool ready_load[16]; // That value comes from an LDR
+    long fetch_ready;    // First cycle fetch can use after a taken branch
+    long cycles;
+} PipelineModel;
+
+// Instruction between fetch and commit in the out-of-order core. Sources and the destination are
+// renamed to the sequence number of the producing reorder buffer entry (-1 = register file).
+typedef struct {
+    long seq;            // Dynamic sequence number, also the tag results are broadcast under
+    int index;           // Instruction memory index
+    uint8_t opcode;
+    int8_t dest;         // GPR written, -1 if none
+    int8_t mem_read;     // Data memory byte read by LDR, -1 if none
+    int8_t mem_write;    // Data memory byte written by STR, -1 if none
+    bool sets_flags;     // Writes SREG
+    int source_count;
+    int8_t source_regs[2];
+    long sources[3];     // Producer tags of the source registers and of the LDR address
+    bool wrong_path;     // Fetched behind a mispredicted BEQZ; squashed when it resolves
+    bool redirect;       // Correct-path taken BEQZ or BR: fetch follows the real path once it executes
+    bool resolved;
+    bool issued;
+    long fetch_cycle;
+    long ready_cycle;    // First cycle the result can be consumed (valid once issued)
+} OooEntry;
+
+typedef struct {
+    int rob_size;
+    int rs_size;
+    int width;
+    OooEntry rob[OOO_MAX_ROB];   // Ring indexed by seq % rob_size, oldest at head_seq
+    long head_seq;
+    long tail_seq;               // Next sequence number to dispatch
+    int rs_used;                 // Dispatched entries waiting to issue
+    OooEntry fetched[2 * PIPELINE_MAX_WIDTH]; // Fetch queue between fetch and rename
+    int fetched_count;
+    long rename[REGISTER_COUNT]; // Newest in-flight producer of each GPR and SREG, -1 = committed
+    long mem_rename[64];         // Newest in-flight STR to each LDR/STR-addressable byte
+    const struct MicroOp *next_op; // Correct-path instruction fetch takes next (NULL = none left)
+    int wrong_path_pc;           // Sequential wrong-path fetch behind a taken BEQZ, -1 when on the right path
+    bool fetch_blocked;          // A correct-path BR is in flight; fetch waits for its target
+    bool halt_committed;
+    long committed;
+    long mispredicts;
+    long squashed;
+    long rob_full_stalls;        // Cycles rename was held by a full reorder buffer
+    long rs_full_stalls;         // Cycles rename was held by full reservation stations
+    long occupancy_sum;          // ROB entries summed over cycles, for the average
+    int occupancy_peak;
+} OooCore;
+
+// Operands of the last flag-setting instruction, kept so SREG can be built only when it is read
+typedef struct {
+    bool pending;    // R65 is stale until read_status_register() rebuilds it
+    int8_t result;
+    int8_t rd_value; // Value of RD after the write (the same register update_status_register() reads)
+    int8_t rs_value;
+} LazyFlags;
+
+// Event counters of the modelled machine, written as JSON by --counters. Per-opcode counts are
+// derived from pc_executed when the report is written.
+typedef struct {
+    long fetch_stalls;    // Cycles fetch was held back by stall_flag (control hazards)
+    long data_stalls;     // Decode interlocks on a RAW dependence on an ALU result
+    long load_use_stalls; // Decode interlocks on a RAW dependence on an LDR
+    long flushes;         // flush() calls (taken BEQZ)
+    long br_flushes;      // flush_BR() calls
+    long squashed;        // Fetched instructions discarded by either flush
+    long beqz_taken;
+    long beqz_not_taken;
+    long beqz_mispredicted;
+    long btb_hits;
+    long btb_misses;
+    long btb_mispredicted;  // BTB hits with a stale target
+    long saved_cycles;      // Cycles won over static not-taken without a BTB
+    long dcache_hits;
+    long dcache_misses;
+    long dcache_writebacks;   // Dirty victims written to data_memory
+    long dcache_stalls;       // Cycles LDR/STR held the pipeline beyond their first
+    long dcache_miss_stalls;  // Part of dcache_stalls spent on misses and writebacks
+    long pc_executed[INSTRUCTION_MEMORY_SIZE];
+    long pc_stalls[INSTRUCTION_MEMORY_SIZE]; // Stall cycles charged to the BR that set stall_flag or the stalled consumer
+} PerfCounters;
+
+// Checkpoints store PerfCounters as a flat array of longs
+_Static_assert(sizeof(PerfCounters) % sizeof(long) == 0, "PerfCounters must hold only longs");
+
+// Predecoded form of an instruction word, built once by load_program for the functional run mode
+struct CPU;
+struct MicroOp;
+typedef const struct MicroOp *(*UopHandler)(struct CPU *cpu, const struct MicroOp *op);
+
+typedef struct MicroOp {
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs1;
+    int8_t immediate;   // Already sign-extended for MOVI and BEQZ
+    UopHandler handler; // Executes the instruction and returns the next micro-op (NULL halts)
+} MicroOp;
+
+// One retired instruction as --trace records it and --trace-read reports it
+typedef struct {
+    uint64_t cycle;
+    int pc;               // Instruction index
+    uint16_t instruction;
+    int8_t reg;           // Register written, -1 for none
+    int8_t reg_value;
+    int address;          // Data memory byte written, -1 for none
+    uint8_t value;
+    uint8_t sreg;
+    uint8_t events;       // TRACE_EVENT_*
+} TraceRecord;
+
+// Double-buffered trace output: the simulation encodes records into one buffer while the writer
+// thread compresses and writes the other, so a run only waits when it outpaces the disk
+typedef struct {
+    FILE *file;
+    const char *filename;
+    uint8_t *buffers[2];
+    int active;           // Buffer the simulation is filling
+    size_t used;
+    uint32_t records;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int pending;          // Buffer handed to the writer thread
+    size_t pending_size;  // 0 when the writer thread is idle
+    uint32_t pending_records;
+    bool closing;
+    bool failed;
+    TraceRecord last;     // Previous record, the base of the delta encoding
+    long flushes, br_flushes, fetch_stalls, data_stalls, memory_stalls; // Counters as of the previous record
+    long total_records;
+    uint64_t file_bytes;
+} TraceWriter;
+
+// Host time of one call path in the --profile tree
+typedef struct {
+    int parent;     // Node index, -1 for the root
+    int stage;      // PROFILE_*
+    uint64_t ticks; // Inclusive, scaled up for sampled cycles
+    long calls;
+} ProfileNode;
+
+typedef struct {
+    const char *file;      // Collapsed stacks are written here
+    bool sampling;         // The current pipeline cycle is timed
+    ProfileNode nodes[PROFILE_MAX_NODES];
+    int node_count;
+    int children[PROFILE_MAX_NODES + 1][PROFILE_STAGES]; // Node index + 1 of each stage under node - 1 (row 0: the root)
+    int stack[PROFILE_MAX_DEPTH];                        // Open nodes, innermost last
+    int scales[PROFILE_MAX_DEPTH];
+    uint64_t overhead[PROFILE_MAX_DEPTH];                // Timer ticks spent inside each open scope
+    int depth;
+    uint64_t timer_ticks;  // What an empty scope measures
+    uint64_t scope_ticks;  // What a timed scope adds to the one around it
+    uint64_t root_start;
+    double start_seconds;
+    uint64_t start_ticks;
+} HostProfile;
+
+static const char *const profile_stage_names[PROFILE_STAGES] = {
+    "main", "load_program", "run", "fetch", "decode", "execute", "update_status_register", "flush", "flush_BR",
+    "print_cpu_state", "print_cpu_delta", "End_program"
+};
+
+// Stores one core made during a multi-core sync window; the last store to an address wins
+typedef struct {
+    uint64_t written;                       // Bit n: byte n was stored to
+    uint8_t values[MULTICORE_SHARED_BYTES];
+} SharedStores;
+
+typedef struct {
+    int length;
+    uint16_t words[FUZZ_MAX_LENGTH];
+    uint8_t data[FUZZ_DATA_BYTES];
+} FuzzCase;
+
+// Run counts of a translated block, kept by its native code and added to the CPU counters at the end
+typedef struct {
+    long executions;
+    long taken;          // Runs that left through a taken BEQZ
+} JitCounter;
+
+typedef struct {
+    int length;          // Micro-ops, zero words included
+    int retired;         // Micro-ops that retire (all but zero words)
+    bool ends_in_beqz;
+} JitBlock;
+
+// Translation cache of one run: native code for the block starting at each PC
+typedef struct {
+    uint8_t *code;       // JIT_CODE_SIZE bytes, writable only while a block is translated
+    size_t used;
+    size_t exit;         // Offset of the code that returns to run_jit()
+    const uint8_t *entries[INSTRUCTION_MEMORY_SIZE + 1]; // NULL until translated; read by native BR
+    JitBlock blocks[INSTRUCTION_MEMORY_SIZE + 1];
+    JitCounter counters[INSTRUCTION_MEMORY_SIZE + 1];
+    struct {
+        size_t site;     // rel32 operand that still jumps to an exit
+        int target;
+    } links[JIT_MAX_LINKS];
+    int link_count;
+} Jit;
+
+typedef int (*JitEntry)(struct CPU *cpu, const uint8_t *code, long *budget, JitCounter *counters,
+                        const uint8_t *const *entries);
+
+// Laid out for reset_cpu(): the loaded program first (a run never changes it), then the large
+// state a run touches sparsely, then everything small, which reset_cpu() copies in one go.
+typedef struct CPU {
     Instruction instruction_memory[INSTRUCTION_MEMORY_SIZE];
+    MicroOp uops[INSTRUCTION_MEMORY_SIZE + 1]; // One extra slot for the halt sentinel
+    int instruction_count;
     uint8_t data_memory[DATA_MEMORY_SIZE];
+    uint32_t dirty_data_lines;         // Bit n: bytes n * DATA_DIRTY_LINE onwards written since the last reset
+    PerfCounters counters;
+    BranchPredictor predictor;
+    DataCache dcache;
+    int8_t logged_registers[REGISTER_COUNT];     // Register values as of the last delta printout
+    uint8_t logged_data_memory[DATA_MEMORY_SIZE]; // Data memory as of the last delta printout
     int8_t registers[REGISTER_COUNT];  // Change to int8_t for signed values
-    PipelineStage fetch, decode, execute;
+    uint8_t reg_used[REGISTER_COUNT];  // Registers named by a decoded instruction (shown by print_cpu_state)
     IFID IFID;
     IDEX IDEX;
-    int instruction_count;
     int stall_flag; // Flag to indicate control hazard stall
+    int forwarding;       // FORWARD_*
+    int8_t written_reg;   // Register execute() wrote this cycle, -1 if none (seen by the hazard unit in decode)
+    bool written_by_load;
+    bool decode_stalled;  // The hazard unit held IFID this cycle, so fetch must not overwrite it
+    int memory_stall;     // Cycles the LDR/STR that last executed still holds every stage
+    long fast_forwarded;  // Instructions a sampled run executed functionally
+    int samples;          // Measured regions of a sampled run, 0 for other runs
+    long measured_cycles;
+    long measured_instructions;
+    int log_level;
+    bool lazy_flags;      // Defer SREG computation until something reads it
+    LazyFlags flags;
+    bool halted;          // Set when a HALT instruction executes
+    long max_cycles;      // Cycle budget for run_pipeline (instruction budget in functional mode), 0 = unlimited
+    long cycle_count;     // Simulated cycles so far
+    long retired_count;   // Instructions that completed execute
+    double host_seconds;  // Host wall time spent in the last run
+    long checkpoint_every;         // Write a snapshot every N cycles, 0 = never
+    const char *checkpoint_prefix; // Snapshots go to <prefix>-<cycle>.ckpt
+    const char *counters_file;     // Where the counters JSON goes after a run ("-" for stdout), NULL = nowhere
+    const char *trace_file;        // Where run_pipeline() records retired instructions, NULL = nowhere
+    TraceWriter *trace;            // Open while run_pipeline() records
+    SharedStores *shared_stores;   // Multi-core runs: this window's stores for the other cores, NULL otherwise
+    SimHooks hooks;                // sim_set_hooks() callbacks of library builds
 } CPU;
 
+_Static_assert(DATA_MEMORY_SIZE / DATA_DIRTY_LINE <= 32, "dirty_data_lines has one bit per line");
+
+// Assembler label: name and the instruction index it marks
+typedef struct {
+    char name[SYMBOL_NAME_LENGTH];
+    uint32_t index;
+} Symbol;
+
+typedef struct {
+    Symbol *entries;
+    int count;
+    int capacity;
+} SymbolTable;
+
+// Assembler input: a file, or text in memory when file is NULL
+typedef struct {
+    FILE *file;
+    const char *text;
+    const char *end;
+} SourceReader;
+
+// Command-line settings applied to every CPU a run creates
+typedef struct {
+    bool functional;
+    bool jit;             // --mode jit: functional results through translated native code
+    int log_level;
+    long max_cycles;
+    bool lazy_flags;
+    long checkpoint_every;
+    const char *checkpoint_prefix;
+    const char *counters_file;
+    const char *trace_file;
+    int predictor;
+    int btb_entries;
+    int forwarding;
+    int pipeline_depth;   // 0 = the cycle-by-cycle 3-stage machine, otherwise a pipeline_descriptions[] depth
+    int issue_width;
+    bool pipeline_sweep;  // Report the CPI of every depth and width instead of running once
+    bool out_of_order;    // --mode ooo
+    int rob_size;
+    int rs_size;
+    int ooo_width;
+    int dcache_size;
+    int dcache_ways;
+    int dcache_line_size;
+    bool dcache_write_back;
+    int dcache_hit_latency;
+    int dcache_miss_latency;
+    long fast_forward;    // Sampled run: instructions executed functionally before the first detailed region
+    int fast_forward_pc;  // ... or the PC that ends the fast-forward, -1 if none
+    long warmup;          // Detailed instructions run before each measured region and left out of its CPI
+    long measure;         // Instructions per measured region, 0 = to the end of the program
+    long sample_every;    // Instructions fast-forwarded between measured regions, 0 = a single region
+} RunOptions;
+
+// One entry of a --batch manifest and the results of running it
+typedef struct {
+    char program_file[MAX_PATH_LENGTH];
+    char data_file[MAX_PATH_LENGTH]; // Empty when the job has no initial data image
+    bool ok;
+    long cycles;
+    long retired;
+    double host_seconds;
+    int8_t registers[REGISTER_COUNT];
+    uint8_t data_memory[DATA_MEMORY_SIZE];
+} BatchJob;
+
+// Jobs [next, end) still owned by one batch worker; other workers steal from it once theirs run out
+typedef struct {
+    atomic_int next;
+    int end;
+} WorkRange;
+
+typedef struct {
+    BatchJob *jobs;
+    WorkRange *ranges;
+    int worker_count;
+    const RunOptions *options;
+} BatchRun;
+
+typedef struct {
+    BatchRun *batch;
+    int id;
+} BatchWorker;
+
+// Sense-reversing spin barrier that also counts the cores still running
+typedef struct {
+    atomic_int arrived;
+    atomic_int generation;
+    atomic_int running;
+    int result;          // Running cores of the window the barrier last closed
+    int count;
+    int spins;           // Polls before yielding; none when the cores outnumber the host's
+} CycleBarrier;
+
+typedef struct MulticoreRun MulticoreRun;
+
+typedef struct {
+    MulticoreRun *run;
+    int id;
+    CPU *cpu;
+    char program_file[MAX_PATH_LENGTH];
+    SharedStores stores[2]; // Alternate windows, so one is read by the other cores while the next fills
+    bool budget_exhausted;
+} MulticoreCore;
+
+struct MulticoreRun {
+    MulticoreCore *cores;
+    int core_count;
+    long window;            // Cycles between synchronisations
+    atomic_int go;          // 0 until a thread exists for every core, then 1 to run or -1 to abandon the run
+    CycleBarrier barrier;
+    long windows;           // Counted by core 0
+    long shared_stores;
+    long conflicts;         // Bytes stored by more than one core in the same window
+};
+
+// Execution modes --bench times every workload in
+typedef struct {
+    const char *name;
+    bool functional;
+    bool jit;
+    bool lazy_flags;
+} BenchMode;
+
+// One line of a --bench baseline file
+typedef struct {
+    char workload[MAX_PATH_LENGTH];
+    char mode[32];
+    double ns_per_instruction;
+} BenchBaseline;
+
+// Lockstep engine state: LOCKSTEP_LANES instances of one program in struct-of-arrays layout.
+// GCC vector extensions lower these to AVX2 (build with -mavx2) or SSE2 operations.
+typedef int8_t LaneVec __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint8_t LaneUVec __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int16_t LanePcVec __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+
+typedef struct {
+    LaneVec registers[64];
+    LaneVec data_memory[DATA_MEMORY_SIZE];
+    LaneVec sreg;           // SREG of lanes with no pending flag update
+    LaneVec flags_result;   // Lazy SREG operands per lane (see LazyFlags)
+    LaneVec flags_rs;
+    LaneVec flags_pending;
+    LaneVec pc_register;    // Architectural PC (R64) per lane
+    LaneVec active;         // Lanes that are still running
+    LanePcVec pc;           // Next micro-op per lane
+    long retired[LOCKSTEP_LANES];
+    long dispatched[LOCKSTEP_LANES]; // Micro-ops run per lane, checked against the instruction budget
+} LockstepGroup;
+
 // Function prototypes
 void initialize_cpu(CPU *cpu);
-void load_program(CPU *cpu, const char *filename);
+void apply_run_options(CPU *cpu, const RunOptions *options);
+void reset_cpu(CPU *cpu, const CPU *template);
+bool load_program(CPU *cpu, const char *filename);
+bool assemble_program(CPU *cpu, const char *filename, SymbolTable *symbols);
+int find_symbol(const SymbolTable *symbols, const char *name);
+void free_symbol_table(SymbolTable *symbols);
+bool write_program_image(const CPU *cpu, const SymbolTable *symbols, const char *filename);
+bool is_program_image(const char *filename);
+bool load_program_image(CPU *cpu, const char *filename);
+bool load_data_image(CPU *cpu, const char *filename);
+bool write_checkpoint(CPU *cpu, const char *filename);
+bool restore_checkpoint(CPU *cpu, const char *filename);
+void run_cpu(CPU *cpu, const RunOptions *options);
+int run_batch(const char *manifest_file, const RunOptions *options, int thread_count, const char *report_file);
+int run_lockstep(const char *program_file, const char *manifest_file, const RunOptions *options, const char *report_file);
+void run_lockstep_lane(LockstepGroup *group, const CPU *program, CPU *cpu, long max_steps);
+void *lockstep_alloc(size_t size);
+void lockstep_free(void *memory);
+int run_bench(const char *manifest_file, const RunOptions *options, const char *baseline_file, const char *save_file, double tolerance);
+int run_trace_reader(const char *filename, const char *query);
+long peak_rss_kib(void);
+int host_core_count(void);
 void print_cpu_state(CPU *cpu);
+void print_cpu_delta(CPU *cpu);
 void run_pipeline(CPU *cpu);
+void predecode_program(CPU *cpu);
+void run_functional(CPU *cpu);
+void run_jit(CPU *cpu);
+const PipelineDescription *find_pipeline_description(int depth);
+void run_pipeline_model(CPU *cpu, int depth, int width);
+int run_pipeline_sweep(const CPU *program, const RunOptions *options);
+void run_out_of_order(CPU *cpu, int rob_size, int rs_size, int width);
+void run_sampled(CPU *cpu, const RunOptions *options);
+int run_fuzz(const RunOptions *options, long cases, uint64_t seed);
+int run_multicore(const char *manifest_file, const RunOptions *options, long window);
+TraceWriter *trace_open(const CPU *cpu, const char *filename);
+bool trace_close(CPU *cpu);
+void trace_retire(CPU *cpu, int pc, uint8_t opcode, int8_t imm);
 void fetch(CPU *cpu);
 void decode(CPU *cpu);
 void execute(CPU *cpu);
@@ -65,32 +756,441 @@ void End_program(CPU *cpu);
 void flush(CPU *cpu, uint8_t imm);
 void flush_BR(CPU *cpu, uint16_t new_pc);
 void erase_IDEX(CPU *cpu);
+void redirect_fetch(CPU *cpu, int8_t pc);
+void predict_fetch(CPU *cpu, int index);
+void train_predictor(CPU *cpu, int index, uint16_t history, bool taken);
 void update_status_register(CPU *cpu, int8_t result, uint8_t rd, uint8_t rs);
+bool is_power_of_two(int value);
+int dcache_access(CPU *cpu, int address, bool write);
+uint8_t compute_status_register(int8_t result, int8_t rd_value, int8_t rs_value);
+int8_t read_status_register(CPU *cpu);
+void print_run_statistics(CPU *cpu);
+bool write_perf_counters(CPU *cpu, const char *filename, const char *mode);
+double host_time(void);
+bool profile_open(const char *filename);
+bool profile_close(void);
 
-int main() {
-    CPU cpu;
-    initialize_cpu(&cpu);
-    load_program(&cpu, "program.txt"); // Replace with your program file
-    run_pipeline(&cpu);
-    return 0;
+// Host profiler (--profile): scoped timers around the simulator's own stages. Collapsed stacks go
+// to the file, one "stage;stage;... ticks" line per call path of self time.
+static HostProfile *host_profile; // Set for the single run main() performs; NULL leaves every timer off
+
+static inline uint64_t profile_ticks(void) {
+#ifdef PROFILE_RDTSC
+    return __rdtsc();
+#else
+    return (uint64_t)(host_time() * 1e9);
+#endif
 }
 
-void initialize_cpu(CPU *cpu) {
-    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++) {
-        cpu->instruction_memory[i].current_Instruction = 0;
-        cpu->instruction_memory[i].fetch.active = false;
-        cpu->instruction_memory[i].decode.active = false;
-        cpu->instruction_memory[i].execute.active = false;
-        cpu->instruction_memory[i].inst_number = i + 1;
+// Open the node for stage under the innermost open one; returns the start tick, 0 if there is no room
+static uint64_t profile_enter(int stage, int scale) {
+    HostProfile *profile = host_profile;
+    int parent = profile->depth > 0 ? profile->stack[profile->depth - 1] : -1;
+    int node = profile->children[parent + 1][stage] - 1;
+    if (node < 0) {
+        if (profile->node_count == PROFILE_MAX_NODES) return 0;
+        node = profile->node_count++;
+        profile->nodes[node] = (ProfileNode){ .parent = parent, .stage = stage };
+        profile->children[parent + 1][stage] = node + 1;
     }
+    if (profile->depth == PROFILE_MAX_DEPTH) return 0;
+    profile->stack[profile->depth] = node;
+    profile->scales[profile->depth] = scale;
+    profile->overhead[profile->depth] = 0;
+    profile->depth++;
+    uint64_t now = profile_ticks();
+    return now ? now : 1;
+}
 
-    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
-        cpu->data_memory[i] = 0;
+static void profile_leave(uint64_t start) {
+    HostProfile *profile = host_profile;
+    uint64_t elapsed = profile_ticks() - start;
+    profile->depth--;
+    // Take out the timers' own cost; sampled stages last tens of ticks, so it would otherwise dominate once scaled
+    uint64_t overhead = profile->timer_ticks + profile->overhead[profile->depth];
+    elapsed = elapsed > overhead ? elapsed - overhead : 0;
+    if (profile->depth > 0) profile->overhead[profile->depth - 1] += profile->scope_ticks + profile->overhead[profile->depth];
+    ProfileNode *node = &profile->nodes[profile->stack[profile->depth]];
+    node->ticks += elapsed * profile->scales[profile->depth];
+    node->calls += profile->scales[profile->depth];
+}
+
+// PROFILE_BEGIN times a stage that runs inside pipeline cycles, only in the cycles picked for
+// sampling; PROFILE_BEGIN_ALWAYS times one that runs a few times per run. One scope per block.
+#define PROFILE_BEGIN(stage) \
+    uint64_t profile_start = host_profile && host_profile->sampling ? profile_enter(stage, PROFILE_SAMPLE_PERIOD) : 0
+#define PROFILE_BEGIN_ALWAYS(stage) uint64_t profile_start = host_profile ? profile_enter(stage, 1) : 0
+#define PROFILE_END() do { if (profile_start) profile_leave(profile_start); } while (0)
+
+#define PROFILE_CALL(stage, call) do { PROFILE_BEGIN(stage); call; PROFILE_END(); } while (0)
+
+#ifndef CA_SIM_LIBRARY
+int main(int argc, char *argv[]) {
+    CPU cpu;
+    const char *program_file = "program.txt";
+    const char *data_file = NULL;
+    const char *manifest_file = NULL;
+    const char *report_file = NULL;
+    const char *lockstep_file = NULL;
+    const char *image_file = NULL;
+    const char *restore_file = NULL;
+    const char *trace_read_file = NULL;
+    const char *trace_query = NULL;
+    long fuzz_cases = 0;
+    uint64_t fuzz_seed = 1;
+    const char *cores_file = NULL;
+    long sync_window = 1;
+    const char *profile_file = NULL;
+    const char *bench_file = NULL;
+    const char *baseline_file = NULL;
+    const char *save_baseline_file = NULL;
+    double tolerance = BENCH_DEFAULT_TOLERANCE;
+    int thread_count = 0;
+    RunOptions options = { .functional = false, .log_level = LOG_FULL, .max_cycles = DEFAULT_MAX_CYCLES, .lazy_flags = true,
+                           .checkpoint_every = 0, .checkpoint_prefix = "checkpoint", .counters_file = NULL,
+                           .trace_file = NULL, .predictor = PREDICT_NOT_TAKEN, .btb_entries = 0, .forwarding = FORWARD_EX,
+                           .pipeline_depth = 0, .issue_width = 1, .pipeline_sweep = false, .out_of_order = false,
+                           .rob_size = OOO_DEFAULT_ROB, .rs_size = OOO_DEFAULT_RS, .ooo_width = OOO_DEFAULT_WIDTH,
+                           .dcache_size = 0, .dcache_ways = DCACHE_DEFAULT_WAYS, .dcache_line_size = DCACHE_DEFAULT_LINE_SIZE,
+                           .dcache_write_back = true, .dcache_hit_latency = DCACHE_DEFAULT_HIT_LATENCY,
+                           .dcache_miss_latency = DCACHE_DEFAULT_MISS_LATENCY, .fast_forward = 0, .fast_forward_pc = -1,
+                           .warmup = 0, .measure = 0, .sample_every = 0 };
+    static char output_buffer[OUTPUT_BUFFER_SIZE];
+
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+
+    static const char usage[] =
+        "Usage: main [--mode pipeline|functional|jit|ooo] [--log silent|summary|delta|full] [--max-cycles N]\n"
+        "            [--flags lazy|eager] [--data image] [--checkpoint-every N] [--checkpoint-prefix P]\n"
+        "            [--counters file|-] [--predictor not-taken|backward|1bit|2bit|gshare] [--btb entries]\n"
+        "            [--forwarding none|ex] [--pipeline depth[xwidth]|all] [--rob N] [--rs N] [--width N]\n"
+        "            [--dcache bytes] [--dcache-ways N] [--dcache-line bytes] [--dcache-write back|through]\n"
+        "            [--dcache-latency hit,miss] [--fast-forward N | --fast-forward-to PC] [--warmup N]\n"
+        "            [--measure N] [--sample-every N] [--trace file] [--profile file] [program file]\n"
+        "       main --restore checkpoint [run options]\n"
+        "       main --batch manifest [--threads N] [--report file] [run options]\n"
+        "       main --lockstep data-image-manifest [--report file] [--max-cycles N] [program file]\n"
+        "       main --assemble image [program file]\n"
+        "       main --trace-read trace [--query R<register>|M<address>|PC<index>]\n"
+        "       main --cores manifest [--sync-window cycles] [pipeline options]\n"
+        "       main --fuzz cases [--seed N] [pipeline options: --forwarding, --predictor, --btb, --dcache..., --flags]\n"
+        "       main --bench suite [--baseline file] [--save-baseline file] [--tolerance percent] [--max-cycles N]\n";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            i++;
+            options.jit = strcmp(argv[i], "jit") == 0;
+            options.functional = options.jit || strcmp(argv[i], "functional") == 0;
+            options.out_of_order = strcmp(argv[i], "ooo") == 0;
+            if (!options.functional && !options.out_of_order && strcmp(argv[i], "pipeline") != 0) {
+                printf("Error: Unknown run mode \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "silent") == 0) {
+                options.log_level = LOG_SILENT;
+            } else if (strcmp(argv[i], "summary") == 0) {
+                options.log_level = LOG_SUMMARY;
+            } else if (strcmp(argv[i], "delta") == 0) {
+                options.log_level = LOG_DELTA;
+            } else if (strcmp(argv[i], "full") == 0) {
+                options.log_level = LOG_FULL;
+            } else {
+                printf("Error: Unknown log level \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--flags") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "lazy") == 0) {
+                options.lazy_flags = true;
+            } else if (strcmp(argv[i], "eager") == 0) {
+                options.lazy_flags = false;
+            } else {
+                printf("Error: Unknown flags mode \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc) {
+            options.max_cycles = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            options.checkpoint_every = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--checkpoint-prefix") == 0 && i + 1 < argc) {
+            options.checkpoint_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--predictor") == 0 && i + 1 < argc) {
+            i++;
+            options.predictor = -1;
+            for (int k = 0; k < (int)(sizeof(predictor_names) / sizeof(predictor_names[0])); k++) {
+                if (strcmp(argv[i], predictor_names[k]) == 0) options.predictor = k;
+            }
+            if (options.predictor < 0) {
+                printf("Error: Unknown branch predictor \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--forwarding") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "none") == 0) {
+                options.forwarding = FORWARD_NONE;
+            } else if (strcmp(argv[i], "ex") == 0) {
+                options.forwarding = FORWARD_EX;
+            } else {
+                printf("Error: Unknown forwarding network \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            i++;
+            options.pipeline_sweep = strcmp(argv[i], "all") == 0;
+            if (!options.pipeline_sweep) {
+                char *end;
+                options.pipeline_depth = (int)strtol(argv[i], &end, 10);
+                options.issue_width = *end == 'x' ? (int)strtol(end + 1, &end, 10) : 1;
+                if (*end != '\0' || !find_pipeline_description(options.pipeline_depth) ||
+                    (options.issue_width != 1 && options.issue_width != 2 && options.issue_width != 4)) {
+                    printf("Error: Unknown pipeline \"%s\" (use 3, 5 or 7 stages and 1, 2 or 4 wide, e.g. 5x2)\n", argv[i]);
+                    return 1;
+                }
+            }
+        } else if (strcmp(argv[i], "--rob") == 0 && i + 1 < argc) {
+            options.rob_size = atoi(argv[++i]);
+            if (options.rob_size < 1 || options.rob_size > OOO_MAX_ROB) {
+                printf("Error: Reorder buffer size must be between 1 and %d entries\n", OOO_MAX_ROB);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--rs") == 0 && i + 1 < argc) {
+            options.rs_size = atoi(argv[++i]);
+            if (options.rs_size < 1 || options.rs_size > OOO_MAX_RS) {
+                printf("Error: Reservation station count must be between 1 and %d\n", OOO_MAX_RS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            options.ooo_width = atoi(argv[++i]);
+            if (options.ooo_width != 1 && options.ooo_width != 2 && options.ooo_width != 4) {
+                printf("Error: Out-of-order width must be 1, 2 or 4\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--dcache") == 0 && i + 1 < argc) {
+            options.dcache_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dcache-ways") == 0 && i + 1 < argc) {
+            options.dcache_ways = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dcache-line") == 0 && i + 1 < argc) {
+            options.dcache_line_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dcache-write") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "back") == 0) {
+                options.dcache_write_back = true;
+            } else if (strcmp(argv[i], "through") == 0) {
+                options.dcache_write_back = false;
+            } else {
+                printf("Error: Unknown write policy \"%s\"\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--dcache-latency") == 0 && i + 1 < argc) {
+            i++;
+            if (sscanf(argv[i], "%d,%d", &options.dcache_hit_latency, &options.dcache_miss_latency) != 2 ||
+                options.dcache_hit_latency < 1 || options.dcache_miss_latency < 0) {
+                printf("Error: Cache latencies must be given as hit,miss cycles with a hit taking at least 1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fast-forward") == 0 && i + 1 < argc) {
+            options.fast_forward = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--fast-forward-to") == 0 && i + 1 < argc) {
+            options.fast_forward_pc = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            options.warmup = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--measure") == 0 && i + 1 < argc) {
+            options.measure = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--sample-every") == 0 && i + 1 < argc) {
+            options.sample_every = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--btb") == 0 && i + 1 < argc) {
+            options.btb_entries = atoi(argv[++i]);
+            if (options.btb_entries < 0 || options.btb_entries > BTB_MAX_ENTRIES) {
+                printf("Error: BTB size must be between 0 and %d entries\n", BTB_MAX_ENTRIES);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--counters") == 0 && i + 1 < argc) {
+            options.counters_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            options.trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace-read") == 0 && i + 1 < argc) {
+            trace_read_file = argv[++i];
+        } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+            trace_query = argv[++i];
+        } else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+            fuzz_cases = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            fuzz_seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            cores_file = argv[++i];
+        } else if (strcmp(argv[i], "--sync-window") == 0 && i + 1 < argc) {
+            sync_window = strtol(argv[++i], NULL, 10);
+            if (sync_window < 1) {
+                printf("Error: The sync window must be at least one cycle\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_file = argv[++i];
+        } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+            data_file = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            manifest_file = argv[++i];
+        } else if (strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc) {
+            lockstep_file = argv[++i];
+        } else if (strcmp(argv[i], "--assemble") == 0 && i + 1 < argc) {
+            image_file = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_file = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_file = argv[++i];
+        } else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc) {
+            save_baseline_file = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            report_file = argv[++i];
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("Error: Unknown option \"%s\", or it is missing its value\n%s", argv[i], usage);
+            return 1;
+        } else {
+            program_file = argv[i];
+        }
     }
 
-    for (int i = 0; i < REGISTER_COUNT; i++) {
-        cpu->registers[i] = 0;
+    if (profile_file && (image_file || trace_read_file || manifest_file || lockstep_file || bench_file || fuzz_cases > 0 ||
+                         cores_file || options.pipeline_sweep)) {
+        printf("Error: --profile times a single run of the simulator\n");
+        return 1;
+    }
+    // Batch, lockstep and bench jobs build caches from these settings too, so check the geometry first
+    if (options.dcache_size > 0) {
+        int lines = options.dcache_line_size > 0 ? options.dcache_size / options.dcache_line_size : 0;
+        if (!is_power_of_two(options.dcache_size) || !is_power_of_two(options.dcache_line_size) ||
+            !is_power_of_two(options.dcache_ways) || options.dcache_line_size > DCACHE_MAX_LINE_SIZE ||
+            lines < options.dcache_ways || lines > DCACHE_MAX_LINES) {
+            printf("Error: The data cache needs power-of-two size, line size (up to %d bytes) and ways, "
+                   "at most %d lines and at least one set\n", DCACHE_MAX_LINE_SIZE, DCACHE_MAX_LINES);
+            return 1;
+        }
+    }
+    if (image_file) {
+        SymbolTable symbols = {0};
+        initialize_cpu(&cpu);
+        bool ok = assemble_program(&cpu, program_file, &symbols) && write_program_image(&cpu, &symbols, image_file);
+        if (ok) {
+            printf("Assembled %d instructions and %d symbols into %s\n", cpu.instruction_count, symbols.count, image_file);
+        }
+        free_symbol_table(&symbols);
+        return ok ? 0 : 1;
+    }
+    if (trace_read_file) {
+        return run_trace_reader(trace_read_file, trace_query);
+    }
+    if (manifest_file) {
+        return run_batch(manifest_file, &options, thread_count, report_file);
+    }
+    if (lockstep_file) {
+        return run_lockstep(program_file, lockstep_file, &options, report_file);
+    }
+    if (bench_file) {
+        return run_bench(bench_file, &options, baseline_file, save_baseline_file, tolerance);
+    }
+    if ((restore_file || options.checkpoint_every > 0) && options.functional) {
+        printf("Error: Checkpoints hold pipeline state and need --mode pipeline\n");
+        return 1;
+    }
+    if (options.fast_forward > 0 || options.fast_forward_pc >= 0 || options.warmup > 0 || options.measure > 0 ||
+        options.sample_every > 0) {
+        if (options.fast_forward < 0 || options.warmup < 0 || options.measure < 0 || options.sample_every < 0 ||
+            (options.sample_every > 0 && options.measure == 0)) {
+            printf("Error: Sampling counts must not be negative, and --sample-every needs --measure\n");
+            return 1;
+        }
+        if (options.functional || options.out_of_order || options.pipeline_depth > 0 || options.pipeline_sweep ||
+            restore_file || options.checkpoint_every > 0) {
+            printf("Error: Sampled runs switch between the functional core and the detailed pipeline "
+                   "and cannot be combined with other run modes or checkpoints\n");
+            return 1;
+        }
+    }
+    if (options.trace_file && (options.functional || options.out_of_order || options.pipeline_depth > 0 ||
+                               options.pipeline_sweep || options.sample_every > 0 || options.measure > 0 ||
+                               options.warmup > 0 || options.fast_forward > 0 || options.fast_forward_pc >= 0)) {
+        printf("Error: --trace records the detailed pipeline (--mode pipeline) and cannot be combined with sampling\n");
+        return 1;
+    }
+    if (options.dcache_size > 0) {
+        if (options.functional || options.out_of_order || options.pipeline_depth > 0 || options.pipeline_sweep) {
+            printf("Error: The data cache is modelled by the detailed pipeline (--mode pipeline)\n");
+            return 1;
+        }
+    }
+    if (options.pipeline_depth > 0 || options.pipeline_sweep || options.out_of_order) {
+        if ((options.out_of_order && (options.pipeline_depth > 0 || options.pipeline_sweep)) || options.functional ||
+            restore_file || options.checkpoint_every > 0) {
+            printf("Error: --pipeline and --mode ooo run their own timing models and cannot be combined with each other, "
+                   "--mode functional or checkpoints\n");
+            return 1;
+        }
+        if (options.predictor != PREDICT_NOT_TAKEN || options.btb_entries > 0) {
+            printf("Error: The timing models fetch static not-taken; --predictor and --btb need the detailed pipeline\n");
+            return 1;
+        }
+    }
+    if (fuzz_cases > 0) {
+        if (options.functional || options.out_of_order || options.pipeline_depth > 0 || options.pipeline_sweep ||
+            options.trace_file || restore_file || options.checkpoint_every > 0 || options.fast_forward > 0 ||
+            options.fast_forward_pc >= 0 || options.warmup > 0 || options.measure > 0 || options.sample_every > 0) {
+            printf("Error: --fuzz checks the detailed pipeline against the functional core and takes only pipeline options\n");
+            return 1;
+        }
+        return run_fuzz(&options, fuzz_cases, fuzz_seed);
+    }
+    if (cores_file) {
+        if (options.functional || options.out_of_order || options.pipeline_depth > 0 || options.pipeline_sweep ||
+            options.trace_file || options.counters_file || restore_file || options.checkpoint_every > 0 ||
+            options.fast_forward > 0 || options.fast_forward_pc >= 0 || options.warmup > 0 || options.measure > 0 ||
+            options.sample_every > 0) {
+            printf("Error: --cores runs one detailed pipeline per core and takes only pipeline options\n");
+            return 1;
+        }
+        return run_multicore(cores_file, &options, sync_window);
+    }
+
+    if (profile_file && !profile_open(profile_file)) {
+        return 1;
+    }
+
+    initialize_cpu(&cpu);
+    apply_run_options(&cpu, &options);
+    if (restore_file) {
+        if (!restore_checkpoint(&cpu, restore_file)) {
+            return 1;
+        }
+        PROFILE_BEGIN_ALWAYS(PROFILE_RUN);
+        run_pipeline(&cpu);
+        PROFILE_END();
+        return profile_close() ? 0 : 1;
+    }
+    if (!load_program(&cpu, program_file) || (data_file && !load_data_image(&cpu, data_file))) {
+        return 1;
     }
+    if (options.pipeline_sweep) {
+        return run_pipeline_sweep(&cpu, &options);
+    }
+    PROFILE_BEGIN_ALWAYS(PROFILE_RUN);
+    run_cpu(&cpu, &options);
+    PROFILE_END();
+    return profile_close() ? 0 : 1;
+}
+#endif
+
+void initialize_cpu(CPU *cpu) {
+    memset(cpu->instruction_memory, 0, sizeof(cpu->instruction_memory));
+    memset(cpu->data_memory, 0, sizeof(cpu->data_memory));
+    cpu->dirty_data_lines = 0;
+    memset(cpu->registers, 0, sizeof(cpu->registers));
+    memset(cpu->reg_used, 0, sizeof(cpu->reg_used));
 
     // Set PC and SREG to their initial locations in the register file
     cpu->registers[64] = 0; // PC is R64
@@ -98,6 +1198,12 @@ void initialize_cpu(CPU *cpu) {
 
     cpu->IFID.instruction = 0;
     cpu->IFID.inst_number = 0;
+    cpu->IFID.predicted = false;
+    cpu->IFID.predicted_pc = 0;
+    cpu->IFID.history = 0;
+    cpu->IDEX.predicted = false;
+    cpu->IDEX.predicted_pc = 0;
+    cpu->IDEX.history = 0;
     cpu->IDEX.immediate = 0;
     cpu->IDEX.opcode = 0;
     cpu->IDEX.rd = 0;
@@ -106,9 +1212,121 @@ void initialize_cpu(CPU *cpu) {
     cpu->IDEX.isempty = 1;
     cpu->instruction_count = 0;
     cpu->stall_flag = 0;
+    cpu->forwarding = FORWARD_EX;
+    cpu->written_reg = -1;
+    cpu->written_by_load = false;
+    cpu->decode_stalled = false;
+    cpu->memory_stall = 0;
+    memset(&cpu->dcache, 0, sizeof(cpu->dcache));
+    cpu->fast_forwarded = 0;
+    cpu->samples = 0;
+    cpu->measured_cycles = 0;
+    cpu->measured_instructions = 0;
+    cpu->log_level = LOG_FULL;
+    cpu->lazy_flags = true;
+    cpu->flags.pending = false;
+    cpu->halted = false;
+    cpu->max_cycles = DEFAULT_MAX_CYCLES;
+    cpu->cycle_count = 0;
+    cpu->retired_count = 0;
+    cpu->host_seconds = 0;
+    cpu->checkpoint_every = 0;
+    cpu->checkpoint_prefix = "checkpoint";
+    memset(&cpu->counters, 0, sizeof(cpu->counters));
+    memset(&cpu->predictor, 0, sizeof(cpu->predictor));
+    for (int i = 0; i < BTB_MAX_ENTRIES; i++) {
+        cpu->predictor.btb[i].pc = -1;
+    }
+    cpu->counters_file = NULL;
+    cpu->trace_file = NULL;
+    cpu->trace = NULL;
+    cpu->shared_stores = NULL;
+    memset(&cpu->hooks, 0, sizeof(cpu->hooks));
+    memset(cpu->logged_registers, 0, sizeof(cpu->logged_registers));
+    memset(cpu->logged_data_memory, 0, sizeof(cpu->logged_data_memory));
+}
+
+static inline void mark_data_dirty(CPU *cpu, int address) {
+    cpu->dirty_data_lines |= 1u << (address / DATA_DIRTY_LINE);
+}
+
+// Return a CPU to the state of template, a copy of it taken after apply_run_options(), load_program()
+// and any data image, without touching the parts a run cannot change. The cost follows what the last
+// run wrote (dirty data lines, counters of the loaded instructions, used cache lines) plus the few
+// hundred bytes of registers and latches, which are cheaper to copy than to track.
+void reset_cpu(CPU *cpu, const CPU *template) {
+    uint32_t dirty = cpu->dirty_data_lines;
+    for (int line = 0; dirty != 0; line++, dirty >>= 1) {
+        if (dirty & 1) {
+            memcpy(cpu->data_memory + line * DATA_DIRTY_LINE, template->data_memory + line * DATA_DIRTY_LINE,
+                   DATA_DIRTY_LINE);
+        }
+    }
+    cpu->dirty_data_lines = 0;
+
+    // Per-PC counters only ever move for instructions of the loaded program
+    size_t per_pc = template->instruction_count * sizeof(long);
+    memcpy(&cpu->counters, &template->counters, offsetof(PerfCounters, pc_executed));
+    memcpy(cpu->counters.pc_executed, template->counters.pc_executed, per_pc);
+    memcpy(cpu->counters.pc_stalls, template->counters.pc_stalls, per_pc);
+
+    // gshare can reach any counter, so the predictor goes back whole
+    cpu->predictor = template->predictor;
+    int cache_lines = template->dcache.size > 0 ? template->dcache.size / template->dcache.line_size : 0;
+    memcpy(&cpu->dcache, &template->dcache, offsetof(DataCache, lines) + cache_lines * sizeof(CacheLine));
+
+    // logged_* are reloaded when a run starts; registers onwards is the small state
+    memcpy((char *)cpu + offsetof(CPU, registers), (const char *)template + offsetof(CPU, registers),
+           sizeof(CPU) - offsetof(CPU, registers));
+}
+
+void apply_run_options(CPU *cpu, const RunOptions *options) {
+    cpu->log_level = options->log_level;
+    cpu->max_cycles = options->max_cycles;
+    cpu->lazy_flags = options->lazy_flags;
+    cpu->checkpoint_every = options->checkpoint_every;
+    cpu->checkpoint_prefix = options->checkpoint_prefix;
+    cpu->counters_file = options->counters_file;
+    cpu->trace_file = options->trace_file;
+    cpu->predictor.kind = options->predictor;
+    cpu->predictor.btb_entries = options->btb_entries;
+    cpu->forwarding = options->forwarding;
+    memset(&cpu->dcache, 0, sizeof(cpu->dcache));
+    cpu->dcache.size = options->dcache_size;
+    if (options->dcache_size > 0) {
+        cpu->dcache.ways = options->dcache_ways;
+        cpu->dcache.line_size = options->dcache_line_size;
+        cpu->dcache.sets = options->dcache_size / options->dcache_line_size / options->dcache_ways;
+        cpu->dcache.write_back = options->dcache_write_back;
+        cpu->dcache.hit_latency = options->dcache_hit_latency;
+        cpu->dcache.miss_latency = options->dcache_miss_latency;
+    }
+    // Two-bit counters start weakly not-taken
+    memset(cpu->predictor.counters, options->predictor == PREDICT_2BIT || options->predictor == PREDICT_GSHARE ? 1 : 0,
+           sizeof(cpu->predictor.counters));
+}
+
+void run_cpu(CPU *cpu, const RunOptions *options) {
+    if (options->fast_forward > 0 || options->fast_forward_pc >= 0 || options->warmup > 0 || options->measure > 0 ||
+        options->sample_every > 0) {
+        run_sampled(cpu, options);
+    } else if (options->pipeline_depth > 0) {
+        run_pipeline_model(cpu, options->pipeline_depth, options->issue_width);
+    } else if (options->out_of_order) {
+        run_out_of_order(cpu, options->rob_size, options->rs_size, options->ooo_width);
+    } else if (options->jit) {
+        run_jit(cpu);
+    } else if (options->functional) {
+        run_functional(cpu);
+    } else {
+        run_pipeline(cpu);
+    }
 }
 
 void End_program(CPU *cpu) {
+    if (cpu->log_level < LOG_SUMMARY) return;
+    PROFILE_BEGIN_ALWAYS(PROFILE_END_PROGRAM);
+
     // Print out the final values of the PC and SREG
     printf("\nFinal CPU State:\n");
     printf("PC: %d\n", cpu->registers[64]);
@@ -121,7 +1339,7 @@ void End_program(CPU *cpu) {
         if (i == 7 || i == 6 || i == 5) {
             printf(" X |"); // Reserved bits (Bits 7, 6, 5) are always 0
         } else {
-            printf(" %d |", (cpu->registers[65] >> i) & 0x01);
+            printf(" %d |", (read_status_register(cpu) >> i) & 0x01);
         }
     }
     printf("\n");
@@ -151,431 +1369,4497 @@ void End_program(CPU *cpu) {
     }
 
     printf("\nEnd of Program Execution.\n");
+    PROFILE_END();
 }
 
-void load_program(CPU *cpu, const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error: Unable to open file %s\n", filename);
-        return;
-    }
+// Instruction formats understood by the assembler
+#define FORMAT_RR 0       // Rd, Rs
+#define FORMAT_SIGNED 1   // Rd, imm (6-bit two's complement, masked like the original loader)
+#define FORMAT_UNSIGNED 2 // Rd, imm (0-63)
+#define FORMAT_NONE 3     // No operands
 
-    char line[256];
-    int instruction_index = 0;
+typedef struct {
+    const char *mnemonic;
+    uint8_t opcode;
+    uint8_t format;
+} OpcodeInfo;
 
-    while (fgets(line, sizeof(line), file)) {
-        if (instruction_index >= INSTRUCTION_MEMORY_SIZE) {
-            printf("Error: Program too large to fit in instruction memory.\n");
-            break;
-        }
+static const OpcodeInfo opcode_table[] = {
+    { "ADD", 0x00, FORMAT_RR },       { "SUB", 0x01, FORMAT_RR },        { "MUL", 0x02, FORMAT_RR },
+    { "MOVI", 0x03, FORMAT_SIGNED },  { "BEQZ", 0x04, FORMAT_SIGNED },   { "ANDI", 0x05, FORMAT_UNSIGNED },
+    { "EOR", 0x06, FORMAT_RR },       { "BR", 0x07, FORMAT_RR },         { "SAL", 0x08, FORMAT_UNSIGNED },
+    { "SAR", 0x09, FORMAT_UNSIGNED }, { "LDR", 0x0A, FORMAT_UNSIGNED },  { "STR", 0x0B, FORMAT_UNSIGNED },
+    { "HALT", HALT_OPCODE, FORMAT_NONE },
+};
 
-        uint8_t rd, rs1;
-        int16_t immediate;  // Use int16_t to capture potential negative values in load
-        uint16_t binary_instruction = 0;
-
-        // Remove newline character if present
-        line[strcspn(line, "\n")] = 0;
-
-        // Parse each instruction based on its format
-        if (sscanf(line, "MOVI R%hhu, %hd", &rd, &immediate) == 2) {
-            binary_instruction = (0x03 << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "ADD R%hhu, R%hhu", &rd, &rs1) == 2) {
-            binary_instruction = (0x00 << 12) | (rd << 8) | (rs1 << 4);
-        } else if (sscanf(line, "SUB R%hhu, R%hhu", &rd, &rs1) == 2) {
-            binary_instruction = (0x01 << 12) | (rd << 8) | (rs1 << 4);
-        } else if (sscanf(line, "MUL R%hhu, R%hhu", &rd, &rs1) == 2) {
-            binary_instruction = (0x02 << 12) | (rd << 8) | (rs1 << 4);
-        } else if (sscanf(line, "BEQZ R%hhu, %hd", &rd, &immediate) == 2) {
-            binary_instruction = (0x04 << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "ANDI R%hhu, %hd", &rd, &immediate) == 2) {
-            if (immediate < 0 || immediate > 63) {
-                printf("Error: ANDI instruction with invalid immediate value %d (valid range is 0-63)\n", immediate);
-                continue;
-            }
-            binary_instruction = (0x05 << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "EOR R%hhu, R%hhu", &rd, &rs1) == 2) {
-            binary_instruction = (0x06 << 12) | (rd << 8) | (rs1 << 4);
-        } else if (sscanf(line, "BR R%hhu, R%hhu", &rd, &rs1) == 2) {
-            binary_instruction = (0x07 << 12) | (rd << 8) | (rs1 << 4);
-        } else if (sscanf(line, "SAL R%hhu, %hd", &rd, &immediate) == 2) {
-            if (immediate < 0 || immediate > 63) {
-                printf("Error: SAL instruction with invalid immediate value %d (valid range is 0-63)\n", immediate);
-                continue;
-            }
-            binary_instruction = (0x08 << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "SAR R%hhu, %hd", &rd, &immediate) == 2) {
-            if (immediate < 0 || immediate > 63) {
-                printf("Error: SAR instruction with invalid immediate value %d (valid range is 0-63)\n", immediate);
-                continue;
-            }
-            binary_instruction = (0x09 << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "LDR R%hhu, %hd", &rd, &immediate) == 2) {
-            if (immediate < 0 || immediate > 63) {
-                printf("Error: LDR instruction with invalid immediate value %d (valid range is 0-63)\n", immediate);
-                continue;
-            }
-            binary_instruction = (0x0A << 12) | (rd << 8) | (immediate & 0x3F);
-        } else if (sscanf(line, "STR R%hhu, %hd", &rd, &immediate) == 2) {
-            if (immediate < 0 || immediate > 63) {
-                printf("Error: STR instruction with invalid immediate value %d (valid range is 0-63)\n", immediate);
-                continue;
-            }
-            binary_instruction = (0x0B << 12) | (rd << 8) | (immediate & 0x3F);
-        } else {
-            printf("Error: Unrecognized instruction \"%s\"\n", line);
-            continue;
+static const OpcodeInfo *lookup_opcode(const char *mnemonic, size_t length) {
+    for (size_t i = 0; i < sizeof(opcode_table) / sizeof(opcode_table[0]); i++) {
+        if (strlen(opcode_table[i].mnemonic) == length && strncasecmp(opcode_table[i].mnemonic, mnemonic, length) == 0) {
+            return &opcode_table[i];
         }
+    }
+    return NULL;
+}
 
-        // Store the binary instruction in the instruction memory
-        cpu->instruction_memory[instruction_index].current_Instruction = binary_instruction;
-        cpu->instruction_memory[instruction_index].inst_number = instruction_index + 1;
-        cpu->instruction_count++;
-        instruction_index++;
+static const OpcodeInfo *find_opcode(uint8_t opcode) {
+    for (size_t i = 0; i < sizeof(opcode_table) / sizeof(opcode_table[0]); i++) {
+        if (opcode_table[i].opcode == opcode) return &opcode_table[i];
     }
+    return NULL;
+}
 
-    fclose(file);
-    printf("Program loaded successfully with %d instructions.\n", instruction_index);
+static const char *skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
 }
 
-void print_cpu_state(CPU *cpu) {
-    printf("Registers:\n");
-    for (int i = 0; i < 64; i++) {
-        if (reg_used[i] != 0) {
-            printf("R%d: %d\n", i, cpu->registers[i]);  // Print as signed integer
-        }
-    }
-    printf("PC: %d\n", cpu->registers[64]);
-    printf("SREG: 0x%X\n", cpu->registers[65]);
-    printf("Data memory:\n");
-    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
-        if (cpu->data_memory[i] != 0) {
-            printf("Index %d: Value {%d}\n", i, cpu->data_memory[i]);
-        }
+static size_t identifier_length(const char *p) {
+    size_t length = 0;
+    if (isalpha((unsigned char)*p) || *p == '_') {
+        while (isalnum((unsigned char)p[length]) || p[length] == '_') length++;
     }
+    return length;
 }
 
-void run_pipeline(CPU *cpu) {
-    int total_instructions = cpu->instruction_count;
-    int total_cycles = 3 + (total_instructions - 1);
-    int current_cycle = 1;
-    while (current_cycle <= total_cycles) {
-        printf("Current Cycle is %d and Current PC is %d\n", current_cycle, cpu->registers[64]);
-
-        // Execute, Decode, and Fetch stages in the correct pipeline order
-        if (current_cycle >= 3 && current_cycle <= total_instructions + 2) {
-            execute(cpu);
-        }
-        if (current_cycle >= 2 && current_cycle <= total_instructions + 1) {
-            decode(cpu);
-            printf("IDEX Register inst %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, isempty=%d\n",
-                   cpu->IDEX.inst_number, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.isempty);
-        }
-        if (current_cycle >= 1 && current_cycle <= total_instructions) {
-            fetch(cpu);
-            printf("IFID Register inst %d: Instruction=0x%04X at the PC %d \n", cpu->IFID.inst_number, cpu->IFID.instruction, cpu->registers[64]);
-        }
+static const char *parse_register(const char *p, int *reg) {
+    p = skip_spaces(p);
+    if (*p != 'R' && *p != 'r') return NULL;
+    char *end;
+    long value = strtol(p + 1, &end, 10);
+    if (end == p + 1) return NULL;
+    *reg = (int)value;
+    return end;
+}
 
-        print_cpu_state(cpu);
-        printf("\n");
-        cpu->stall_flag = 0;
-        current_cycle++;
-    }
+static const char *parse_comma(const char *p) {
+    p = skip_spaces(p);
+    return *p == ',' ? p + 1 : NULL;
+}
 
-    End_program(cpu);
+// Decimal or 0x-prefixed hexadecimal number
+static const char *parse_number(const char *p, long *value) {
+    p = skip_spaces(p);
+    const char *digits = p + (*p == '-' || *p == '+');
+    int base = (digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) ? 16 : 10;
+    char *end;
+    *value = strtol(p, &end, base);
+    return end == p ? NULL : end;
 }
 
-void fetch(CPU *cpu) {
-    if (cpu->stall_flag) return; // Skip fetch if stalled
+int find_symbol(const SymbolTable *symbols, const char *name) {
+    for (int i = 0; i < symbols->count; i++) {
+        if (strcmp(symbols->entries[i].name, name) == 0) return (int)symbols->entries[i].index;
+    }
+    return -1;
+}
 
-    if (cpu->registers[64] < cpu->instruction_count) {
-        cpu->IFID.instruction = cpu->instruction_memory[cpu->registers[64]].current_Instruction;
-        cpu->IFID.inst_number = cpu->instruction_memory[cpu->registers[64]].inst_number;
-        cpu->registers[64]++;
-        printf("Fetching Instruction %d:  0x%04X\n", cpu->IFID.inst_number, cpu->IFID.instruction);
+static bool add_symbol(SymbolTable *symbols, const char *name, size_t length, uint32_t index) {
+    if (symbols->count == symbols->capacity) {
+        int capacity = symbols->capacity ? 2 * symbols->capacity : 32;
+        Symbol *grown = realloc(symbols->entries, capacity * sizeof(Symbol));
+        if (!grown) return false;
+        symbols->entries = grown;
+        symbols->capacity = capacity;
     }
+    Symbol *symbol = &symbols->entries[symbols->count++];
+    memset(symbol, 0, sizeof(*symbol));
+    memcpy(symbol->name, name, length);
+    symbol->index = index;
+    return true;
 }
 
-void decode(CPU *cpu) {
-    if (cpu->IFID.instruction != 0 && cpu->IDEX.isempty == 1) {
-        uint16_t instruction = cpu->IFID.instruction;
-        int inst_num = cpu->IFID.inst_number;
+void free_symbol_table(SymbolTable *symbols) {
+    free(symbols->entries);
+    symbols->entries = NULL;
+    symbols->count = symbols->capacity = 0;
+}
 
-        cpu->IDEX.inst_number = inst_num;
-        cpu->IDEX.opcode = (instruction >> 12) & 0xF;  // Extract the opcode (first 4 bits)
+// Next line of assembler source, as fgets() returns it
+static bool read_source_line(SourceReader *source, char *line, int size) {
+    if (source->file) {
+        return fgets(line, size, source->file) != NULL;
+    }
+    if (source->text >= source->end) return false;
+    int length = 0;
+    while (length < size - 1 && source->text < source->end) {
+        char c = *source->text++;
+        line[length++] = c;
+        if (c == '\n') break;
+    }
+    line[length] = 0;
+    return true;
+}
+
+// Single pass over the source: each line is tokenized once, mnemonics come from opcode_table and
+// label operands are recorded as fixups that are patched once every label is known.
+// Syntax: [label:] [MNEMONIC operands] [; or # or // comment], plus ".data address, value, ..."
+static bool assemble_source(CPU *cpu, SourceReader *source, const char *name, SymbolTable *symbols) {
+    typedef struct {
+        int index;        // Instruction to patch
+        int line_number;
+        char label[SYMBOL_NAME_LENGTH];
+    } Fixup;
+    Fixup *fixups = NULL;
+    int fixup_count = 0, fixup_capacity = 0;
+
+    char line[256];
+    int line_number = 0;
+    int instruction_index = 0;
+    int errors = 0; // Lines and label operands that could not be assembled
+
+    while (read_source_line(source, line, sizeof(line))) {
+        line_number++;
+        line[strcspn(line, ";#\r\n")] = 0;
+        char *comment = strstr(line, "//");
+        if (comment) *comment = 0;
+
+        const char *p = skip_spaces(line);
+        size_t length = identifier_length(p);
+
+        // Label definitions
+        if (length > 0 && *skip_spaces(p + length) == ':') {
+            if (length >= SYMBOL_NAME_LENGTH) {
+                printf("Error: Label too long on line %d\n", line_number);
+                errors++;
+            } else {
+                char name[SYMBOL_NAME_LENGTH] = {0};
+                memcpy(name, p, length);
+                if (find_symbol(symbols, name) >= 0) {
+                    printf("Error: Label \"%s\" defined twice (line %d)\n", name, line_number);
+                    errors++;
+                } else {
+                    add_symbol(symbols, p, length, instruction_index);
+                }
+            }
+            p = skip_spaces(skip_spaces(p + length) + 1);
+            length = identifier_length(p);
+        }
+        if (*p == 0) continue;
+
+        // Data directive: .data address, value, value, ...
+        if (strncasecmp(p, ".data", 5) == 0) {
+            long address, value;
+            p = parse_number(p + 5, &address);
+            while (p && *skip_spaces(p) == ',') {
+                p = parse_number(parse_comma(p), &value);
+                if (!p || address < 0 || address >= DATA_MEMORY_SIZE) {
+                    p = NULL;
+                    break;
+                }
+                mark_data_dirty(cpu, address);
+                cpu->data_memory[address++] = (uint8_t)value;
+            }
+            if (!p || *skip_spaces(p) != 0) {
+                printf("Error: Invalid .data directive on line %d\n", line_number);
+                errors++;
+            }
+            continue;
+        }
+
+        const OpcodeInfo *info = lookup_opcode(p, length);
+        if (!info) {
+            printf("Error: Unrecognized instruction \"%s\"\n", skip_spaces(line));
+            errors++;
+            continue;
+        }
+        if (instruction_index >= INSTRUCTION_MEMORY_SIZE) {
+            printf("Error: Program too large to fit in instruction memory.\n");
+            errors++;
+            break;
+        }
+
+        int rd = 0, rs1 = 0;
+        long immediate = 0;
+        const char *label = NULL;
+        size_t label_length = 0;
+        p += length;
+        if (info->format != FORMAT_NONE) {
+            p = parse_register(p, &rd);
+            if (p) p = parse_comma(p);
+            if (p && info->format == FORMAT_RR) {
+                p = parse_register(p, &rs1);
+            } else if (p) {
+                // An immediate is either a number or a label
+                const char *operand = skip_spaces(p);
+                label_length = identifier_length(operand);
+                if (label_length > 0 && label_length < SYMBOL_NAME_LENGTH) {
+                    label = operand;
+                    p = operand + label_length;
+                } else {
+                    p = parse_number(p, &immediate);
+                }
+            }
+        }
+        if (!p || *skip_spaces(p) != 0) {
+            printf("Error: Unrecognized instruction \"%s\"\n", skip_spaces(line));
+            errors++;
+            continue;
+        }
+        if (rd < 0 || rd > 15 || rs1 < 0 || rs1 > 15) {
+            printf("Error: %s instruction on line %d uses a register outside R0-R15\n", info->mnemonic, line_number);
+            errors++;
+            continue;
+        }
+        if (info->format == FORMAT_UNSIGNED && !label && (immediate < 0 || immediate > 63)) {
+            printf("Error: %s instruction with invalid immediate value %ld (valid range is 0-63)\n", info->mnemonic, immediate);
+            errors++;
+            continue;
+        }
+
+        if (label) {
+            if (fixup_count == fixup_capacity) {
+                fixup_capacity = fixup_capacity ? 2 * fixup_capacity : 32;
+                Fixup *grown = realloc(fixups, fixup_capacity * sizeof(Fixup));
+                if (!grown) {
+                    printf("Error: Out of memory assembling %s\n", name);
+                    errors++;
+                    break;
+                }
+                fixups = grown;
+            }
+            Fixup *fixup = &fixups[fixup_count++];
+            memset(fixup->label, 0, sizeof(fixup->label));
+            memcpy(fixup->label, label, label_length);
+            fixup->index = instruction_index;
+            fixup->line_number = line_number;
+        }
+
+        uint16_t binary_instruction = (info->opcode << 12) | (rd << 8);
+        if (info->format == FORMAT_RR) {
+            binary_instruction |= rs1 << 4;
+        } else if (info->format != FORMAT_NONE) {
+            binary_instruction |= immediate & 0x3F;
+        }
+
+        // Store the binary instruction in the instruction memory
+        cpu->instruction_memory[instruction_index].current_Instruction = binary_instruction;
+        instruction_index++;
+    }
+    cpu->instruction_count = instruction_index;
+
+    // BEQZ labels become the offset flush() needs to land on them; other immediates take the
+    // label's instruction index
+    for (int f = 0; f < fixup_count; f++) {
+        uint16_t *word = &cpu->instruction_memory[fixups[f].index].current_Instruction;
+        int target = find_symbol(symbols, fixups[f].label);
+        if (target < 0) {
+            printf("Error: Undefined label \"%s\" on line %d\n", fixups[f].label, fixups[f].line_number);
+            errors++;
+            continue;
+        }
+
+        int value = target;
+        int low = 0, high = 63;
+        if (((*word >> 12) & 0xF) == 0x04) {
+            int next_fetch = fixups[f].index + 2 < instruction_index ? fixups[f].index + 2 : instruction_index;
+            value = target - next_fetch + 1;
+            low = -32;
+            high = 31;
+        } else if (((*word >> 12) & 0xF) == 0x03) {
+            high = 31;
+        }
+        if (value < low || value > high) {
+            printf("Error: Label \"%s\" is out of range for the instruction on line %d\n", fixups[f].label, fixups[f].line_number);
+            errors++;
+            continue;
+        }
+        *word = (*word & ~0x3F) | (value & 0x3F);
+    }
+    free(fixups);
+    return errors == 0;
+}
+
+bool assemble_program(CPU *cpu, const char *filename, SymbolTable *symbols) {
+    SourceReader source = { .file = fopen(filename, "r") };
+    if (!source.file) {
+        printf("Error: Unable to open file %s\n", filename);
+        return false;
+    }
+    bool ok = assemble_source(cpu, &source, filename, symbols);
+    fclose(source.file);
+    return ok;
+}
+
+bool load_program(CPU *cpu, const char *filename) {
+    PROFILE_BEGIN_ALWAYS(PROFILE_LOAD_PROGRAM);
+    bool ok;
+    if (is_program_image(filename)) {
+        ok = load_program_image(cpu, filename);
+    } else {
+        SymbolTable symbols = {0};
+        ok = assemble_program(cpu, filename, &symbols);
+        free_symbol_table(&symbols);
+        if (ok) {
+            predecode_program(cpu);
+            LOG(cpu, LOG_SUMMARY, "Program loaded successfully with %d instructions.\n", cpu->instruction_count);
+        }
+    }
+    PROFILE_END();
+    return ok;
+}
+
+static void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t value) {
+    put_u16(p, value & 0xFFFF);
+    put_u16(p + 2, value >> 16);
+}
+
+static void put_u64(uint8_t *p, uint64_t value) {
+    put_u32(p, value & 0xFFFFFFFF);
+    put_u32(p + 4, value >> 32);
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+bool write_program_image(const CPU *cpu, const SymbolTable *symbols, const char *filename) {
+    size_t size = IMAGE_HEADER_SIZE + 2 * cpu->instruction_count + DATA_MEMORY_SIZE + IMAGE_SYMBOL_SIZE * symbols->count;
+    uint8_t *image = calloc(1, size);
+    if (!image) {
+        printf("Error: Out of memory writing %s\n", filename);
+        return false;
+    }
+
+    memcpy(image, IMAGE_MAGIC, 4);
+    put_u16(image + 4, IMAGE_VERSION);
+    put_u16(image + 6, cpu->instruction_count);
+    put_u16(image + 8, DATA_MEMORY_SIZE);
+    put_u16(image + 10, symbols->count);
+    uint8_t *p = image + IMAGE_HEADER_SIZE;
+    for (int i = 0; i < cpu->instruction_count; i++, p += 2) {
+        put_u16(p, cpu->instruction_memory[i].current_Instruction);
+    }
+    memcpy(p, cpu->data_memory, DATA_MEMORY_SIZE);
+    p += DATA_MEMORY_SIZE;
+    for (int i = 0; i < symbols->count; i++, p += IMAGE_SYMBOL_SIZE) {
+        put_u32(p, symbols->entries[i].index);
+        memcpy(p + 4, symbols->entries[i].name, SYMBOL_NAME_LENGTH);
+    }
+
+    FILE *file = fopen(filename, "wb");
+    bool ok = file && fwrite(image, 1, size, file) == size;
+    if (file && fclose(file) != 0) ok = false;
+    if (!ok) {
+        printf("Error: Unable to write file %s\n", filename);
+    }
+    free(image);
+    return ok;
+}
+
+bool is_program_image(const char *filename) {
+    char magic[4];
+    FILE *file = fopen(filename, "rb");
+    if (!file) return false;
+    bool match = fread(magic, 1, 4, file) == 4 && memcmp(magic, IMAGE_MAGIC, 4) == 0;
+    fclose(file);
+    return match;
+}
+
+// Read-only view of a whole file: mmap where available, a heap copy otherwise
+static const uint8_t *map_file(const char *filename, size_t *size) {
+#ifdef _WIN32
+    FILE *file = fopen(filename, "rb");
+    if (!file) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = length > 0 ? malloc(length) : NULL;
+    if (data && fread(data, 1, length, file) != (size_t)length) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = data ? (size_t)length : 0;
+    return data;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    *size = info.st_size;
+    return data;
+#endif
+}
+
+static void unmap_file(const uint8_t *data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    free((void *)data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+// Program and data of an image in memory; name is only used in errors
+static bool load_image_data(CPU *cpu, const uint8_t *image, size_t size, const char *name) {
+    int instruction_count = size >= IMAGE_HEADER_SIZE ? get_u16(image + 6) : 0;
+    int data_size = size >= IMAGE_HEADER_SIZE ? get_u16(image + 8) : 0;
+    if (size < IMAGE_HEADER_SIZE || memcmp(image, IMAGE_MAGIC, 4) != 0 || get_u16(image + 4) != IMAGE_VERSION ||
+        instruction_count > INSTRUCTION_MEMORY_SIZE || data_size != DATA_MEMORY_SIZE ||
+        size < IMAGE_HEADER_SIZE + 2 * (size_t)instruction_count + DATA_MEMORY_SIZE) {
+        printf("Error: %s is not a valid version %d program image\n", name, IMAGE_VERSION);
+        return false;
+    }
+
+    const uint8_t *words = image + IMAGE_HEADER_SIZE;
+    for (int i = 0; i < instruction_count; i++) {
+        cpu->instruction_memory[i].current_Instruction = get_u16(words + 2 * i);
+    }
+    cpu->instruction_count = instruction_count;
+    memcpy(cpu->data_memory, words + 2 * instruction_count, DATA_MEMORY_SIZE);
+    cpu->dirty_data_lines = ~0u;
+
+    predecode_program(cpu);
+    LOG(cpu, LOG_SUMMARY, "Program loaded successfully with %d instructions.\n", instruction_count);
+    return true;
+}
+
+bool load_program_image(CPU *cpu, const char *filename) {
+    size_t size;
+    const uint8_t *image = map_file(filename, &size);
+    if (!image) {
+        printf("Error: Unable to open file %s\n", filename);
+        return false;
+    }
+    bool ok = load_image_data(cpu, image, size, filename);
+    unmap_file(image, size);
+    return ok;
+}
+
+// Initial machine state: one "address value" pair per line for data memory, or "Rn value" to preset
+// general register n. Blank lines and # comments are ignored.
+bool load_data_image(CPU *cpu, const char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        printf("Error: Unable to open file %s\n", filename);
+        return false;
+    }
+
+    char line[256];
+    int line_number = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file)) {
+        int address, value;
+        line_number++;
+        line[strcspn(line, "#\r\n")] = 0;
+        if (line[strspn(line, " \t")] == 0) continue;
+
+        if (sscanf(line, " R%d %d", &address, &value) == 2 && address >= 0 && address < 64) {
+            cpu->registers[address] = (int8_t)value;
+            continue;
+        }
+        if (sscanf(line, "%d %d", &address, &value) != 2 || address < 0 || address >= DATA_MEMORY_SIZE) {
+            printf("Error: Invalid data image entry on line %d of %s\n", line_number, filename);
+            ok = false;
+            continue;
+        }
+        mark_data_dirty(cpu, address);
+        cpu->data_memory[address] = (uint8_t)value;
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// Snapshot of everything run_pipeline() needs to carry on from the end of the current cycle.
+// SREG is materialized first so the file does not depend on the lazy/eager flags setting.
+bool write_checkpoint(CPU *cpu, const char *filename) {
+    size_t size = CHECKPOINT_HEADER_SIZE + CHECKPOINT_STATE_SIZE + 2 * cpu->instruction_count + DATA_MEMORY_SIZE;
+    uint8_t *snapshot = calloc(1, size);
+    if (!snapshot) {
+        printf("Error: Out of memory writing %s\n", filename);
+        return false;
+    }
+
+    read_status_register(cpu);
+    memcpy(snapshot, CHECKPOINT_MAGIC, 4);
+    put_u16(snapshot + 4, CHECKPOINT_VERSION);
+    put_u16(snapshot + 6, cpu->instruction_count);
+    put_u64(snapshot + 8, cpu->cycle_count);
+    put_u64(snapshot + 16, cpu->retired_count);
+    uint8_t *p = snapshot + CHECKPOINT_HEADER_SIZE;
+    memcpy(p, cpu->registers, REGISTER_COUNT);
+    p += REGISTER_COUNT;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        if (cpu->reg_used[i]) p[i / 8] |= 1 << (i % 8);
+    }
+    p += (REGISTER_COUNT + 7) / 8;
+    put_u16(p, cpu->IFID.instruction);
+    put_u16(p + 2, cpu->IFID.inst_number);
+    p[4] = cpu->IFID.predicted;
+    p[5] = (uint8_t)cpu->IFID.predicted_pc;
+    put_u16(p + 6, cpu->IFID.history);
+    p += 8;
+    p[0] = cpu->IDEX.opcode;
+    p[1] = cpu->IDEX.rd;
+    p[2] = cpu->IDEX.rs1;
+    p[3] = (uint8_t)cpu->IDEX.immediate;
+    put_u16(p + 4, cpu->IDEX.inst_number);
+    p[6] = cpu->IDEX.isempty;
+    p[7] = cpu->IDEX.predicted;
+    p[8] = (uint8_t)cpu->IDEX.predicted_pc;
+    put_u16(p + 9, cpu->IDEX.history);
+    p += 11;
+    p[0] = cpu->stall_flag;
+    p[1] = cpu->halted;
+    p[2] = cpu->forwarding;
+    p += 3;
+    p[0] = cpu->predictor.kind;
+    p[1] = cpu->predictor.btb_entries;
+    put_u16(p + 2, cpu->predictor.history);
+    memcpy(p + 4, cpu->predictor.counters, INSTRUCTION_MEMORY_SIZE);
+    p += 4 + INSTRUCTION_MEMORY_SIZE;
+    for (int i = 0; i < BTB_MAX_ENTRIES; i++, p += 3) {
+        put_u16(p, (uint16_t)cpu->predictor.btb[i].pc);
+        p[2] = (uint8_t)cpu->predictor.btb[i].target;
+    }
+    const DataCache *cache = &cpu->dcache;
+    put_u32(p, cpu->memory_stall);
+    put_u16(p + 4, cache->size);
+    put_u16(p + 6, cache->ways);
+    put_u16(p + 8, cache->line_size);
+    p[10] = cache->write_back;
+    put_u16(p + 12, cache->hit_latency);
+    put_u16(p + 14, cache->miss_latency);
+    put_u64(p + 16, cache->tick);
+    p += 24;
+    for (int i = 0; i < DCACHE_MAX_LINES; i++, p += 11) {
+        put_u16(p, cache->lines[i].tag);
+        p[2] = cache->lines[i].valid | cache->lines[i].dirty << 1;
+        put_u64(p + 3, cache->lines[i].last_used);
+    }
+    const long *counters = (const long *)&cpu->counters;
+    for (size_t i = 0; i < sizeof(PerfCounters) / sizeof(long); i++, p += 8) {
+        put_u64(p, (uint64_t)counters[i]);
+    }
+    for (int i = 0; i < cpu->instruction_count; i++, p += 2) {
+        put_u16(p, cpu->instruction_memory[i].current_Instruction);
+    }
+    memcpy(p, cpu->data_memory, DATA_MEMORY_SIZE);
+
+    // Write to a temporary name and rename it into place so a killed run never leaves a torn snapshot
+    char temporary[MAX_PATH_LENGTH + 4];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    FILE *file = fopen(temporary, "wb");
+    bool ok = file && fwrite(snapshot, 1, size, file) == size;
+    if (file && fclose(file) != 0) ok = false;
+#ifdef _WIN32
+    if (ok) remove(filename);
+#endif
+    if (ok && rename(temporary, filename) != 0) ok = false;
+    if (!ok) {
+        remove(temporary);
+        printf("Error: Unable to write checkpoint %s\n", filename);
+    }
+    free(snapshot);
+    return ok;
+}
+
+bool restore_checkpoint(CPU *cpu, const char *filename) {
+    size_t size;
+    const uint8_t *snapshot = map_file(filename, &size);
+    if (!snapshot) {
+        printf("Error: Unable to open file %s\n", filename);
+        return false;
+    }
+
+    int instruction_count = size >= CHECKPOINT_HEADER_SIZE ? get_u16(snapshot + 6) : 0;
+    if (size < CHECKPOINT_HEADER_SIZE || memcmp(snapshot, CHECKPOINT_MAGIC, 4) != 0 ||
+        get_u16(snapshot + 4) != CHECKPOINT_VERSION || instruction_count > INSTRUCTION_MEMORY_SIZE ||
+        size != CHECKPOINT_HEADER_SIZE + CHECKPOINT_STATE_SIZE + 2 * (size_t)instruction_count + DATA_MEMORY_SIZE) {
+        printf("Error: %s is not a valid version %d checkpoint\n", filename, CHECKPOINT_VERSION);
+        unmap_file(snapshot, size);
+        return false;
+    }
+
+    cpu->cycle_count = (long)get_u64(snapshot + 8);
+    cpu->retired_count = (long)get_u64(snapshot + 16);
+    const uint8_t *p = snapshot + CHECKPOINT_HEADER_SIZE;
+    memcpy(cpu->registers, p, REGISTER_COUNT);
+    p += REGISTER_COUNT;
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        cpu->reg_used[i] = (p[i / 8] >> (i % 8)) & 1;
+    }
+    p += (REGISTER_COUNT + 7) / 8;
+    cpu->IFID.instruction = get_u16(p);
+    cpu->IFID.inst_number = get_u16(p + 2);
+    cpu->IFID.predicted = p[4];
+    cpu->IFID.predicted_pc = (int8_t)p[5];
+    cpu->IFID.history = get_u16(p + 6);
+    p += 8;
+    cpu->IDEX.opcode = p[0];
+    cpu->IDEX.rd = p[1];
+    cpu->IDEX.rs1 = p[2];
+    cpu->IDEX.immediate = (int8_t)p[3];
+    cpu->IDEX.inst_number = get_u16(p + 4);
+    cpu->IDEX.isempty = p[6];
+    cpu->IDEX.predicted = p[7];
+    cpu->IDEX.predicted_pc = (int8_t)p[8];
+    cpu->IDEX.history = get_u16(p + 9);
+    p += 11;
+    cpu->stall_flag = p[0];
+    cpu->halted = p[1];
+    cpu->forwarding = p[2] == FORWARD_NONE ? FORWARD_NONE : FORWARD_EX;
+    p += 3;
+    // The predictor and forwarding network the snapshot was taken with win over --predictor/--btb/--forwarding
+    cpu->predictor.kind = p[0] <= PREDICT_GSHARE ? p[0] : PREDICT_NOT_TAKEN;
+    cpu->predictor.btb_entries = p[1] <= BTB_MAX_ENTRIES ? p[1] : 0;
+    cpu->predictor.history = get_u16(p + 2);
+    memcpy(cpu->predictor.counters, p + 4, INSTRUCTION_MEMORY_SIZE);
+    p += 4 + INSTRUCTION_MEMORY_SIZE;
+    for (int i = 0; i < BTB_MAX_ENTRIES; i++, p += 3) {
+        cpu->predictor.btb[i].pc = (int16_t)get_u16(p);
+        cpu->predictor.btb[i].target = (int8_t)p[2];
+    }
+    // So does its data cache, which is only rebuilt from a valid geometry
+    DataCache *cache = &cpu->dcache;
+    memset(cache, 0, sizeof(*cache));
+    cpu->memory_stall = (int)get_u32(p);
+    int cache_size = get_u16(p + 4), ways = get_u16(p + 6), line_size = get_u16(p + 8);
+    if (cache_size > 0 && is_power_of_two(cache_size) && is_power_of_two(ways) && is_power_of_two(line_size) &&
+        line_size <= DCACHE_MAX_LINE_SIZE && cache_size / line_size >= ways && cache_size / line_size <= DCACHE_MAX_LINES) {
+        cache->size = cache_size;
+        cache->ways = ways;
+        cache->line_size = line_size;
+        cache->sets = cache_size / line_size / ways;
+        cache->write_back = p[10];
+        cache->hit_latency = get_u16(p + 12);
+        cache->miss_latency = get_u16(p + 14);
+        cache->tick = get_u64(p + 16);
+    }
+    p += 24;
+    for (int i = 0; i < DCACHE_MAX_LINES; i++, p += 11) {
+        cache->lines[i].tag = get_u16(p);
+        cache->lines[i].valid = p[2] & 1;
+        cache->lines[i].dirty = (p[2] >> 1) & 1;
+        cache->lines[i].last_used = get_u64(p + 3);
+    }
+    long *counters = (long *)&cpu->counters;
+    for (size_t i = 0; i < sizeof(PerfCounters) / sizeof(long); i++, p += 8) {
+        counters[i] = (long)get_u64(p);
+    }
+    for (int i = 0; i < instruction_count; i++, p += 2) {
+        cpu->instruction_memory[i].current_Instruction = get_u16(p);
+    }
+    cpu->instruction_count = instruction_count;
+    memcpy(cpu->data_memory, p, DATA_MEMORY_SIZE);
+    cpu->dirty_data_lines = ~0u;
+    cpu->flags.pending = false;
+    unmap_file(snapshot, size);
+
+    predecode_program(cpu);
+    LOG(cpu, LOG_SUMMARY, "Restored %s at cycle %ld with %d instructions.\n", filename, cpu->cycle_count, instruction_count);
+    return true;
+}
+
+void print_cpu_state(CPU *cpu) {
+    printf("Registers:\n");
+    for (int i = 0; i < 64; i++) {
+        if (cpu->reg_used[i] != 0) {
+            printf("R%d: %d\n", i, cpu->registers[i]);  // Print as signed integer
+        }
+    }
+    printf("PC: %d\n", cpu->registers[64]);
+    printf("SREG: 0x%X\n", read_status_register(cpu));
+    printf("Data memory:\n");
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+        if (cpu->data_memory[i] != 0) {
+            printf("Index %d: Value {%d}\n", i, cpu->data_memory[i]);
+        }
+    }
+}
+
+void print_cpu_delta(CPU *cpu) {
+    read_status_register(cpu);
+    if (memcmp(cpu->logged_registers, cpu->registers, sizeof(cpu->registers)) != 0) {
+        for (int i = 0; i < REGISTER_COUNT; i++) {
+            if (cpu->registers[i] == cpu->logged_registers[i]) continue;
+            if (i == 64) {
+                printf("PC: %d -> %d\n", cpu->logged_registers[i], cpu->registers[i]);
+            } else if (i == 65) {
+                printf("SREG: 0x%X -> 0x%X\n", (uint8_t)cpu->logged_registers[i], (uint8_t)cpu->registers[i]);
+            } else {
+                printf("R%d: %d -> %d\n", i, cpu->logged_registers[i], cpu->registers[i]);
+            }
+            cpu->logged_registers[i] = cpu->registers[i];
+        }
+    }
+
+    if (memcmp(cpu->logged_data_memory, cpu->data_memory, sizeof(cpu->data_memory)) != 0) {
+        for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+            if (cpu->data_memory[i] == cpu->logged_data_memory[i]) continue;
+            printf("Index %d: Value {%d} -> {%d}\n", i, cpu->logged_data_memory[i], cpu->data_memory[i]);
+            cpu->logged_data_memory[i] = cpu->data_memory[i];
+        }
+    }
+}
+
+// True once the PC has left the program and the last instruction has left IFID and IDEX
+static bool pipeline_drained(CPU *cpu) {
+    int8_t pc = cpu->registers[64];
+    return (pc < 0 || pc >= cpu->instruction_count) && cpu->IFID.instruction == 0 && cpu->IDEX.isempty == 1 &&
+           cpu->memory_stall == 0;
+}
+
+// One clock of the detailed machine: execute, decode and fetch, then the trace and any checkpoint due
+static inline void pipeline_cycle(CPU *cpu) {
+    cpu->cycle_count++;
+    if (host_profile) {
+        host_profile->sampling = cpu->cycle_count % PROFILE_SAMPLE_PERIOD == 0;
+    }
+    LOG(cpu, LOG_DELTA, "Current Cycle is %ld and Current PC is %d\n", cpu->cycle_count, cpu->registers[64]);
+
+    // Execute, Decode, and Fetch stages in the correct pipeline order
+    // An LDR/STR still in the data cache holds execute, and decode and fetch behind it, until
+    // its last cycle. written_reg keeps its destination, so the hazard unit sees it then.
+    if (cpu->memory_stall > 0) {
+        cpu->memory_stall--;
+        LOG(cpu, LOG_DELTA, "Memory stall: instruction %d waits for the data cache\n", cpu->IDEX.inst_number);
+    } else {
+        PROFILE_CALL(PROFILE_EXECUTE, execute(cpu));
+    }
+    if (!cpu->halted && cpu->memory_stall == 0) {
+        if (cpu->IFID.instruction != 0) {
+            PROFILE_CALL(PROFILE_DECODE, decode(cpu));
+            LOG(cpu, LOG_DELTA, "IDEX Register inst %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, isempty=%d\n",
+                   cpu->IDEX.inst_number, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.isempty);
+        }
+        if (cpu->registers[64] >= 0 && cpu->registers[64] < cpu->instruction_count) {
+            PROFILE_CALL(PROFILE_FETCH, fetch(cpu));
+            LOG(cpu, LOG_DELTA, "IFID Register inst %d: Instruction=0x%04X at the PC %d \n", cpu->IFID.inst_number, cpu->IFID.instruction, cpu->registers[64]);
+        }
+    }
+
+    if (cpu->log_level >= LOG_FULL) {
+        PROFILE_CALL(PROFILE_PRINT_STATE, print_cpu_state(cpu));
+    } else if (cpu->log_level == LOG_DELTA) {
+        PROFILE_CALL(PROFILE_PRINT_DELTA, print_cpu_delta(cpu));
+    }
+    LOG(cpu, LOG_DELTA, "\n");
+    cpu->stall_flag = 0;
+    cpu->decode_stalled = false;
+    if (host_profile) {
+        host_profile->sampling = false;
+    }
+
+    if (cpu->checkpoint_every > 0 && cpu->cycle_count % cpu->checkpoint_every == 0) {
+        char filename[MAX_PATH_LENGTH];
+        snprintf(filename, sizeof(filename), "%s-%ld.ckpt", cpu->checkpoint_prefix, cpu->cycle_count);
+        write_checkpoint(cpu, filename);
+    }
+}
+
+void run_pipeline(CPU *cpu) {
+    double start = host_time();
+
+    // Delta printouts are relative to the state the run starts from
+    read_status_register(cpu);
+    memcpy(cpu->logged_registers, cpu->registers, sizeof(cpu->registers));
+    memcpy(cpu->logged_data_memory, cpu->data_memory, sizeof(cpu->data_memory));
+    if (cpu->trace_file && !(cpu->trace = trace_open(cpu, cpu->trace_file))) {
+        return;
+    }
+
+    while (!cpu->halted && !pipeline_drained(cpu)) {
+        if (cpu->max_cycles > 0 && cpu->cycle_count >= cpu->max_cycles) {
+            LOG(cpu, LOG_SUMMARY, "Cycle budget of %ld cycles exhausted, stopping the run\n", cpu->max_cycles);
+            break;
+        }
+        pipeline_cycle(cpu);
+    }
+
+    if (cpu->trace) {
+        trace_close(cpu);
+    }
+    cpu->host_seconds = host_time() - start;
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->counters_file) {
+        write_perf_counters(cpu, cpu->counters_file, "pipeline");
+    }
+}
+
+// sim.h API: the detailed pipeline driven cycle by cycle from a host program
+CPU *sim_create(void) {
+    CPU *cpu = malloc(sizeof(CPU));
+    if (!cpu) return NULL;
+    initialize_cpu(cpu);
+    cpu->log_level = LOG_SILENT;
+    cpu->max_cycles = 0; // The host decides how long to run
+    return cpu;
+}
+
+void sim_destroy(CPU *cpu) {
+    free(cpu);
+}
+
+// Fresh state for a new program; the host's hooks and log level survive
+static void sim_reset(CPU *cpu) {
+    SimHooks hooks = cpu->hooks;
+    int log_level = cpu->log_level;
+    initialize_cpu(cpu);
+    cpu->hooks = hooks;
+    cpu->log_level = log_level;
+    cpu->max_cycles = 0;
+}
+
+bool sim_load_program(CPU *cpu, const void *buffer, size_t size) {
+    sim_reset(cpu);
+    bool ok;
+    if (size >= 4 && memcmp(buffer, IMAGE_MAGIC, 4) == 0) {
+        ok = load_image_data(cpu, buffer, size, "program image");
+    } else {
+        SymbolTable symbols = {0};
+        SourceReader source = { .text = buffer, .end = (const char *)buffer + size };
+        ok = assemble_source(cpu, &source, "program source", &symbols);
+        free_symbol_table(&symbols);
+        if (ok) {
+            predecode_program(cpu);
+        }
+    }
+    if (!ok) {
+        sim_reset(cpu); // Nothing half-assembled is left to run
+    }
+    return ok;
+}
+
+bool sim_finished(const CPU *cpu) {
+    return cpu->halted || pipeline_drained((CPU *)cpu);
+}
+
+long sim_step(CPU *cpu, long cycles) {
+    long start = cpu->cycle_count;
+    while (cpu->cycle_count - start < cycles && !sim_finished(cpu)) {
+        pipeline_cycle(cpu);
+    }
+    return cpu->cycle_count - start;
+}
+
+long sim_run_until(CPU *cpu, long cycle, int pc) {
+    long start = cpu->cycle_count;
+    while (!sim_finished(cpu) && (cycle < 0 || cpu->cycle_count < cycle)) {
+        pipeline_cycle(cpu);
+        if (pc >= 0 && !cpu->IDEX.isempty && cpu->IDEX.inst_number - 1 == pc && cpu->memory_stall == 0) break;
+    }
+    return cpu->cycle_count - start;
+}
+
+long sim_cycles(const CPU *cpu) {
+    return cpu->cycle_count;
+}
+
+long sim_retired(const CPU *cpu) {
+    return cpu->retired_count;
+}
+
+int8_t sim_read_register(CPU *cpu, int reg) {
+    if (reg < 0 || reg >= REGISTER_COUNT) return 0;
+    return reg == 65 ? read_status_register(cpu) : cpu->registers[reg];
+}
+
+void sim_write_register(CPU *cpu, int reg, int8_t value) {
+    if (reg < 0 || reg >= REGISTER_COUNT) return;
+    if (reg == 64) {
+        // A new PC discards what the pipeline fetched from the old one
+        cpu->IFID.instruction = 0;
+        cpu->IFID.inst_number = 0;
+        cpu->IFID.predicted = false;
+        erase_IDEX(cpu);
+    } else if (reg == 65) {
+        cpu->flags.pending = false;
+    }
+    cpu->registers[reg] = value;
+}
+
+uint8_t sim_read_memory(const CPU *cpu, int address) {
+    return address >= 0 && address < DATA_MEMORY_SIZE ? cpu->data_memory[address] : 0;
+}
+
+void sim_write_memory(CPU *cpu, int address, uint8_t value) {
+    if (address < 0 || address >= DATA_MEMORY_SIZE) return;
+    mark_data_dirty(cpu, address);
+    cpu->data_memory[address] = value;
+}
+
+void sim_set_hooks(CPU *cpu, const SimHooks *hooks) {
+    if (hooks) {
+        cpu->hooks = *hooks;
+    } else {
+        memset(&cpu->hooks, 0, sizeof(cpu->hooks));
+    }
+}
+
+// PC a sequential fetch has reached when the instruction at index executes: the pipeline has
+// fetched one more instruction, if there was one. BEQZ offsets and HALT's final PC are based on it.
+static int8_t branch_base_pc(const CPU *cpu, int index) {
+    return index + 2 < cpu->instruction_count ? index + 2 : cpu->instruction_count;
+}
+
+// Same wrap-around as flush(): the offset is added as an unsigned byte and stored into the int8 PC
+static int8_t beqz_target(const CPU *cpu, int index, int8_t imm) {
+    uint16_t new_pc = branch_base_pc(cpu, index) + ((uint8_t)imm - 1);
+    return (int8_t)new_pc;
+}
+
+static bool opcode_writes_rd(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00: case 0x01: case 0x02: case 0x03: case 0x05: case 0x06: case 0x08: case 0x09: case 0x0A:
+            return true; // ADD, SUB, MUL, MOVI, ANDI, EOR, SAL, SAR, LDR
+        default:
+            return false;
+    }
+}
+
+// Registers an instruction word reads when it executes; returns how many were stored in regs
+static int instruction_sources(uint16_t instruction, int regs[2]) {
+    regs[0] = (instruction >> 8) & 0xF;
+    regs[1] = (instruction >> 4) & 0xF;
+    switch ((instruction >> 12) & 0xF) {
+        case 0x00: case 0x01: case 0x02: case 0x06: case 0x07:
+            return 2; // ADD, SUB, MUL, EOR, BR
+        case 0x04: case 0x05: case 0x08: case 0x09: case 0x0B:
+            return 1; // BEQZ, ANDI, SAL, SAR, STR
+        default:
+            return 0; // MOVI, LDR, HALT
+    }
+}
+
+// Without forwarding, hold IFID in decode while it reads a register the instruction leaving
+// execute this cycle has just written. Returns true when decode has to wait.
+static bool data_hazard(CPU *cpu) {
+    if (cpu->forwarding != FORWARD_NONE || cpu->written_reg < 0) return false;
+
+    int regs[2];
+    int count = instruction_sources(cpu->IFID.instruction, regs);
+    for (int i = 0; i < count; i++) {
+        if (regs[i] == cpu->written_reg) {
+            if (cpu->written_by_load) {
+                cpu->counters.load_use_stalls++;
+            } else {
+                cpu->counters.data_stalls++;
+            }
+            cpu->counters.pc_stalls[cpu->IFID.inst_number - 1]++;
+            LOG(cpu, LOG_DELTA, "Data hazard: instruction %d waits in decode for R%d\n", cpu->IFID.inst_number, regs[i]);
+            cpu->decode_stalled = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void fetch(CPU *cpu) {
+    if (cpu->stall_flag) { // Skip fetch if stalled
+        cpu->counters.fetch_stalls++;
+        cpu->counters.pc_stalls[cpu->IDEX.inst_number - 1]++;
+        return;
+    }
+    if (cpu->decode_stalled) return; // Decode is holding IFID for a data hazard
+
+    if (cpu->registers[64] >= 0 && cpu->registers[64] < cpu->instruction_count) {
+        int index = cpu->registers[64];
+        cpu->IFID.instruction = cpu->instruction_memory[cpu->registers[64]].current_Instruction;
+        cpu->IFID.inst_number = index + 1;
+        cpu->registers[64]++;
+        cpu->IFID.predicted = false;
+        if (cpu->predictor.kind != PREDICT_NOT_TAKEN || cpu->predictor.btb_entries > 0) {
+            predict_fetch(cpu, index);
+        }
+        LOG(cpu, LOG_DELTA, "Fetching Instruction %d:  0x%04X\n", cpu->IFID.inst_number, cpu->IFID.instruction);
+    }
+}
+
+void decode(CPU *cpu) {
+    if (cpu->IFID.instruction != 0 && cpu->IDEX.isempty == 1) {
+        if (data_hazard(cpu)) return;
+
+        uint16_t instruction = cpu->IFID.instruction;
+        int inst_num = cpu->IFID.inst_number;
+
+        cpu->IDEX.inst_number = inst_num;
+        cpu->IDEX.opcode = (instruction >> 12) & 0xF;  // Extract the opcode (first 4 bits)
+
+        switch (cpu->IDEX.opcode) {
+            case 0x00: // ADD
+            case 0x01: // SUB
+            case 0x02: // MUL
+            case 0x06: // EOR
+                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
+                cpu->IDEX.rs1 = (instruction >> 4) & 0xF; // Source register 1 (next 4 bits)
+                cpu->IDEX.immediate = 0;                  // No immediate value for R-type instructions
+                break;
+
+            case 0x03: // MOVI
+            case 0x04: // BEQZ
+                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
+                cpu->IDEX.rs1 = 0;                        // No source register for I-type instructions
+                cpu->IDEX.immediate = instruction & 0x3F; // Immediate value (last 6 bits)
+                if (cpu->IDEX.immediate & 0x20) { // Handle sign extension for negative IMM
+                    cpu->IDEX.immediate |= 0xC0;
+                }
+                break;
+
+            case 0x05: // ANDI
+            case 0x08: // SAL
+            case 0x09: // SAR
+            case 0x0A: // LDR
+            case 0x0B: // STR
+                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
+                cpu->IDEX.rs1 = 0;                        // No source register for I-type instructions
+                cpu->IDEX.immediate = instruction & 0x3F; // Immediate value (last 6 bits)
+                if (cpu->IDEX.immediate < 0 || cpu->IDEX.immediate > 63) {
+                    printf("Error: Instruction with invalid immediate value %d (valid range is 0-63)\n", cpu->IDEX.immediate);
+                    erase_IDEX(cpu);
+                    return;
+                }
+                break;
+
+            case 0x07: // BR
+                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
+                cpu->IDEX.rs1 = (instruction >> 4) & 0xF; // Source register 1 (next 4 bits)
+                cpu->IDEX.immediate = 0;                  // No immediate value for BR instruction
+                if (!cpu->IFID.predicted) {
+                    cpu->stall_flag = 1;                  // Stall the pipeline for control hazard unless the BTB hit
+                }
+                break;
+
+            case HALT_OPCODE:
+                cpu->IDEX.rd = 0;
+                cpu->IDEX.rs1 = 0;
+                cpu->IDEX.immediate = 0;
+                break;
+
+            default:
+                printf("Error: Unknown opcode 0x%X\n", cpu->IDEX.opcode);
+                cpu->IDEX.isempty = 1;
+                return;
+        }
+
+        // Mark registers as used
+        if (cpu->IDEX.rd != 0) {
+            cpu->reg_used[cpu->IDEX.rd] = 1;
+        }
+
+        if (cpu->IDEX.rs1 != 0) {
+            cpu->reg_used[cpu->IDEX.rs1] = 1;
+        }
+
+        // Update pipeline registers
+        cpu->IFID.instruction = 0;  // Clear IFID register after decoding
+        cpu->IDEX.isempty = 0;      // Mark the IDEX register as full
+        cpu->IDEX.predicted = cpu->IFID.predicted;
+        cpu->IDEX.predicted_pc = cpu->IFID.predicted_pc;
+        cpu->IDEX.history = cpu->IFID.history;
+
+        // Print decoded instruction for debugging
+        LOG(cpu, LOG_DELTA, "Decoded Instruction %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X\n", 
+               inst_num, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate);
+    }
+}
+
+void erase_IDEX(CPU *cpu) {
+    // Reset all fields in the IDEX pipeline register
+    cpu->IDEX.opcode = 0;
+    cpu->IDEX.rd = 0;
+    cpu->IDEX.rs1 = 0;
+    cpu->IDEX.immediate = 0;
+    cpu->IDEX.inst_number = 0;
+    cpu->IDEX.isempty = 1;  // Mark the IDEX stage as empty
+    cpu->IDEX.predicted = false;
+}
+
+void flush(CPU *cpu, uint8_t imm) {
+    LOG(cpu, LOG_DELTA, "Flushing pipeline due to branch instruction with immediate value %d\n", imm);
+    uint16_t new_pc = cpu->registers[64] + (imm - 1);
+    if (new_pc >= 0) {
+        cpu->registers[64] = new_pc;
+    } else {
+        printf("Branch is cancelled due to negative PC\n");
+        return;
+    }
+    PROFILE_BEGIN(PROFILE_FLUSH);
+    cpu->counters.flushes++;
+    cpu->counters.squashed += cpu->IFID.instruction != 0;
+
+    // Flush both IFID and IDEX registers and branch to PC + Imm instruction if it exists
+    LOG(cpu, LOG_DELTA, "Flushing IFID and IDEX registers\n");
+
+    // Flush IFID
+    LOG(cpu, LOG_DELTA, "Flushing IFID: Instruction=0x%04X, Inst_Num=%d\n",
+           cpu->IFID.instruction, cpu->IFID.inst_number);
+    cpu->IFID.instruction = 0;  // Clear IFID register
+    cpu->IFID.inst_number = 0;
+    cpu->IFID.predicted = false;
+
+    // Flush IDEX
+    LOG(cpu, LOG_DELTA, "Flushing IDEX: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, Inst_Num=%d\n",
+           cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.inst_number);
+    erase_IDEX(cpu);
+    SIM_HOOK(cpu, on_flush, cpu->registers[64]);
+
+    if (cpu->registers[64] >= cpu->instruction_count) {
+        LOG(cpu, LOG_DELTA, "Warning: Branch target out of bounds, PC=%d\n", cpu->registers[64]);
+    } else {
+        LOG(cpu, LOG_DELTA, "Branching to instruction %d at PC=%d\n", cpu->registers[64] + 1, cpu->registers[64]);
+    }
+    PROFILE_END();
+}
+
+void flush_BR(CPU *cpu, uint16_t new_pc) {
+    if (new_pc < 0) {
+        printf("Branch is cancelled due to negative PC\n");
+        return;
+    }
+    PROFILE_BEGIN(PROFILE_FLUSH_BR);
+    LOG(cpu, LOG_DELTA, "Flushing pipeline due to BR instruction with new PC value %d\n", new_pc);
+    cpu->counters.br_flushes++;
+    cpu->counters.squashed += cpu->IFID.instruction != 0;
+
+    // Flush both IFID and IDEX registers and branch to new PC
+    LOG(cpu, LOG_DELTA, "Flushing IFID and IDEX registers\n");
+
+    // Flush IFID
+    LOG(cpu, LOG_DELTA, "Flushing IFID: Instruction=0x%04X, Inst_Num=%d\n",
+           cpu->IFID.instruction, cpu->IFID.inst_number);
+    cpu->IFID.instruction = 0;  // Clear IFID register
+    cpu->IFID.inst_number = 0;
+    cpu->IFID.predicted = false;
+
+    // Flush IDEX
+    LOG(cpu, LOG_DELTA, "Flushing IDEX: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, Inst_Num=%d\n",
+           cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.inst_number);
+    erase_IDEX(cpu);
+
+    cpu->registers[64] = new_pc - 1;
+    SIM_HOOK(cpu, on_flush, cpu->registers[64]);
+
+    if (cpu->registers[64] >= cpu->instruction_count) {
+        LOG(cpu, LOG_DELTA, "Warning: Branch target out of bounds, PC=%d\n", cpu->registers[64]);
+    } else {
+        LOG(cpu, LOG_DELTA, "Branching to instruction %d at PC=%d\n", cpu->registers[64] + 1, cpu->registers[64]);
+    }
+    PROFILE_END();
+}
+
+// Squash the wrong-path instruction in IFID and fetch from pc next
+void redirect_fetch(CPU *cpu, int8_t pc) {
+    LOG(cpu, LOG_DELTA, "Mispredicted branch: flushing IFID (Instruction=0x%04X) and fetching from PC=%d\n",
+        cpu->IFID.instruction, pc);
+    cpu->counters.squashed += cpu->IFID.instruction != 0;
+    cpu->IFID.instruction = 0;
+    cpu->IFID.inst_number = 0;
+    cpu->IFID.predicted = false;
+    cpu->registers[64] = pc;
+    SIM_HOOK(cpu, on_flush, pc);
+}
+
+static int gshare_index(int index, uint16_t history) {
+    return (index ^ history) & (INSTRUCTION_MEMORY_SIZE - 1);
+}
+
+// Called by fetch() once the word at index is in IFID: follow a predicted-taken BEQZ or a BTB hit
+void predict_fetch(CPU *cpu, int index) {
+    const BranchPredictor *predictor = &cpu->predictor;
+    uint16_t instruction = cpu->IFID.instruction;
+    uint8_t opcode = (instruction >> 12) & 0xF;
+    bool taken = false;
+    int8_t target = 0;
+
+    if (opcode == 0x04 && predictor->kind != PREDICT_NOT_TAKEN) {
+        int8_t imm = instruction & 0x3F;
+        if (imm & 0x20) imm |= 0xC0;
+        target = beqz_target(cpu, index, imm);
+        switch (predictor->kind) {
+            case PREDICT_BACKWARD: taken = target <= index; break;
+            case PREDICT_1BIT: taken = predictor->counters[index] != 0; break;
+            case PREDICT_2BIT: taken = predictor->counters[index] >= 2; break;
+            case PREDICT_GSHARE: taken = predictor->counters[gshare_index(index, predictor->history)] >= 2; break;
+        }
+    } else if (opcode == 0x07 && predictor->btb_entries > 0) {
+        const BTBEntry *entry = &predictor->btb[index % predictor->btb_entries];
+        taken = entry->pc == index;
+        target = entry->target;
+    }
+
+    cpu->IFID.predicted = taken;
+    cpu->IFID.predicted_pc = target;
+    cpu->IFID.history = predictor->history;
+    if (taken) {
+        cpu->registers[64] = target;
+    }
+}
+
+// Update the direction predictor with the outcome of the BEQZ at index, predicted with gshare history
+void train_predictor(CPU *cpu, int index, uint16_t history, bool taken) {
+    BranchPredictor *predictor = &cpu->predictor;
+    uint8_t *counter = NULL;
+    switch (predictor->kind) {
+        case PREDICT_1BIT:
+            predictor->counters[index] = taken;
+            return;
+        case PREDICT_2BIT:
+            counter = &predictor->counters[index];
+            break;
+        case PREDICT_GSHARE:
+            counter = &predictor->counters[gshare_index(index, history)];
+            predictor->history = ((predictor->history << 1) | taken) & ((1 << GSHARE_HISTORY_BITS) - 1);
+            break;
+        default:
+            return;
+    }
+    if (taken && *counter < 3) (*counter)++;
+    if (!taken && *counter > 0) (*counter)--;
+}
+
+// Flags are derived from the result and the operand registers as they are after the write,
+// so RD already holds the result when this runs
+void update_status_register(CPU *cpu, int8_t result, uint8_t rd, uint8_t rs) {
+    PROFILE_BEGIN(PROFILE_UPDATE_SREG);
+    if (cpu->lazy_flags) {
+        cpu->flags.pending = true;
+        cpu->flags.result = result;
+        cpu->flags.rd_value = cpu->registers[rd];
+        cpu->flags.rs_value = cpu->registers[rs];
+    } else {
+        cpu->registers[65] = compute_status_register(result, cpu->registers[rd], cpu->registers[rs]); // Update SREG
+    }
+    PROFILE_END();
+}
+
+uint8_t compute_status_register(int8_t result, int8_t rd_value, int8_t rs_value) {
+    uint8_t sreg = 0;
+
+    // Carry Flag (C)
+    if (((int16_t)rd_value + (int16_t)rs_value) > 127 ||
+        ((int16_t)rd_value - (int16_t)rs_value) < -128) {
+        sreg |= CARRY_FLAG;
+    }
+
+    // Two's Complement Overflow Flag (V)
+    if (((rd_value > 0) && (rs_value > 0) && (result < 0)) || 
+        ((rd_value < 0) && (rs_value < 0) && (result > 0))) {
+        sreg |= OVERFLOW_FLAG;
+    }
+
+    // Negative Flag (N)
+    if (result < 0) {
+        sreg |= NEGATIVE_FLAG;
+    }
+
+    // Zero Flag (Z)
+    if (result == 0) {
+        sreg |= ZERO_FLAG;
+    }
+
+    // Sign Flag (S) = N ⊕ V
+    if (((sreg & NEGATIVE_FLAG) >> 2) ^ ((sreg & OVERFLOW_FLAG) >> 1)) {
+        sreg |= SIGN_FLAG;
+    }
+
+    return sreg;
+}
+
+// Every reader of R65 goes through here so a pending lazy update is applied first
+int8_t read_status_register(CPU *cpu) {
+    if (cpu->flags.pending) {
+        cpu->registers[65] = compute_status_register(cpu->flags.result, cpu->flags.rd_value, cpu->flags.rs_value);
+        cpu->flags.pending = false;
+    }
+    return cpu->registers[65];
+}
+
+bool is_power_of_two(int value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+// Cycles an LDR/STR spends reaching address through the data cache. Only timing and tags are
+// modelled; the bytes always live in data_memory.
+int dcache_access(CPU *cpu, int address, bool write) {
+    DataCache *cache = &cpu->dcache;
+    int block = address / cache->line_size;
+    uint16_t tag = block / cache->sets;
+    CacheLine *set = &cache->lines[(block % cache->sets) * cache->ways];
+    int cycles = cache->hit_latency;
+    cache->tick++;
+
+    for (int w = 0; w < cache->ways; w++) {
+        if (!set[w].valid || set[w].tag != tag) continue;
+        cpu->counters.dcache_hits++;
+        set[w].last_used = cache->tick;
+        if (write && cache->write_back) {
+            set[w].dirty = true;
+        } else if (write) {
+            cycles += cache->miss_latency; // Write-through: the store also goes to data_memory
+        }
+        return cycles;
+    }
+
+    cpu->counters.dcache_misses++;
+    if (write && !cache->write_back) {
+        cycles += cache->miss_latency; // No write-allocate
+    } else {
+        CacheLine *victim = &set[0];
+        for (int w = 1; w < cache->ways && victim->valid; w++) {
+            if (!set[w].valid || set[w].last_used < victim->last_used) victim = &set[w];
+        }
+        if (victim->valid && victim->dirty) {
+            cpu->counters.dcache_writebacks++;
+            cycles += cache->miss_latency;
+        }
+        cycles += cache->miss_latency;
+        *victim = (CacheLine){ .tag = tag, .valid = true, .dirty = write, .last_used = cache->tick };
+    }
+    cpu->counters.dcache_miss_stalls += cycles - cache->hit_latency;
+    return cycles;
+}
+
+// Keep the LDR/STR in execute for the cycles of an access beyond the first
+static void hold_for_memory(CPU *cpu, int cycles) {
+    if (cycles <= 1) return;
+    cpu->memory_stall = cycles - 1;
+    cpu->counters.dcache_stalls += cycles - 1;
+    cpu->counters.pc_stalls[cpu->IDEX.inst_number - 1] += cycles - 1;
+}
+
+void execute(CPU *cpu) {
+    cpu->written_reg = -1;
+    if (cpu->IDEX.isempty == 0 && cpu->stall_flag == 0) {
+        uint8_t opcode = cpu->IDEX.opcode;
+        uint8_t rd = cpu->IDEX.rd;
+        uint8_t rs = cpu->IDEX.rs1;
+        int8_t imm = cpu->IDEX.immediate;
+        int8_t result = 0;
+
+        if (opcode_writes_rd(opcode)) {
+            cpu->written_reg = rd;
+            cpu->written_by_load = opcode == 0x0A;
+        }
+
+        int index = cpu->IDEX.inst_number - 1; // Before a flush erases IDEX
+        cpu->counters.pc_executed[index]++;
+        switch (opcode) {
+            case 0x00: // ADD
+                result = cpu->registers[rd] + cpu->registers[rs];
+                cpu->registers[rd] = result;
+                update_status_register(cpu, result, rd, rs);
+                break;
+            case 0x01: // SUB
+                result = cpu->registers[rd] - cpu->registers[rs];
+                cpu->registers[rd] = result;
+                update_status_register(cpu, result, rd, rs);
+                break;
+            case 0x02: // MUL
+                result = cpu->registers[rd] * cpu->registers[rs];
+                cpu->registers[rd] = result;
+                update_status_register(cpu, result, rd, rs);
+                break;
+            case 0x03: // MOVI
+                cpu->registers[rd] = imm;  // Store signed value directly
+                update_status_register(cpu, imm, rd, 0);
+                break;
+            case 0x04: { // BEQZ
+                bool taken = cpu->registers[rd] == 0;
+                train_predictor(cpu, index, cpu->IDEX.history, taken);
+                if (taken && cpu->IDEX.predicted) {
+                    LOG(cpu, LOG_DELTA, "BEQZ to %d: Branch Taken as predicted because R%d = %d\n", imm, rd, cpu->registers[rd]);
+                    cpu->counters.beqz_taken++;
+                    cpu->counters.saved_cycles += cpu->IDEX.predicted_pc >= 0 && cpu->IDEX.predicted_pc < cpu->instruction_count;
+                } else if (taken) {
+                    LOG(cpu, LOG_DELTA, "@PC=%d  BEQZ to %d: Branch Taken because R%d = %d\n", cpu->registers[64], imm, rd, cpu->registers[rd]);
+                    cpu->counters.beqz_taken++;
+                    cpu->counters.beqz_mispredicted++;
+                    cpu->registers[64] = branch_base_pc(cpu, index); // Fetch may have followed a BTB hit since
+                    flush(cpu, imm);  // Call flush function for branch
+                } else {
+                    cpu->counters.beqz_not_taken++;
+                    LOG(cpu, LOG_DELTA, "BEQZ to %d: Branch Not Taken because R%d = %d\n", imm, rd, cpu->registers[rd]);
+                    if (cpu->IDEX.predicted) {
+                        cpu->counters.beqz_mispredicted++;
+                        cpu->counters.saved_cycles -= index + 1 < cpu->instruction_count;
+                        redirect_fetch(cpu, index + 1);
+                    }
+                }
+                break;
+            }
+            case 0x05: // ANDI
+                if (imm >= 0 && imm <= 63) {
+                    result = cpu->registers[rd] & imm;
+                    cpu->registers[rd] = result;
+                    update_status_register(cpu, result, rd, 0);
+                } else {
+                    printf("Error: ANDI executed with invalid immediate value %d (valid range is 0-63)\n", imm);
+                }
+                break;
+            case 0x06: // EOR
+                result = cpu->registers[rd] ^ cpu->registers[rs];
+                cpu->registers[rd] = result;
+                update_status_register(cpu, result, rd, rs);
+                break;
+            case 0x07: { // BR
+                // Concatenate R1 and R2 and take the first 10 bits
+                uint16_t concat_value = ((uint16_t)cpu->registers[rd] << 8) | cpu->registers[rs];
+                uint16_t new_pc = concat_value >> 6;
+                int8_t target = new_pc - 1; // The PC flush_BR() sets
+                if (cpu->predictor.btb_entries > 0) {
+                    BTBEntry *entry = &cpu->predictor.btb[index % cpu->predictor.btb_entries];
+                    if (cpu->IDEX.predicted) {
+                        cpu->counters.btb_hits++;
+                    } else {
+                        cpu->counters.btb_misses++;
+                    }
+                    entry->pc = index;
+                    entry->target = target;
+                }
+                if (cpu->IDEX.predicted && cpu->IDEX.predicted_pc == target) {
+                    LOG(cpu, LOG_DELTA, "BR to %d: target predicted by the BTB\n", new_pc);
+                    cpu->counters.saved_cycles += target >= 0 && target < cpu->instruction_count;
+                } else {
+                    if (cpu->IDEX.predicted) {
+                        cpu->counters.btb_mispredicted++;
+                    }
+                    flush_BR(cpu, new_pc);
+                }
+                break;
+            }
+            case 0x08: // SAL
+                if (imm >= 0 && imm <= 63) {
+                    result = cpu->registers[rd] << imm;
+                    cpu->registers[rd] = result;
+                    update_status_register(cpu, result, rd, 0);
+                } else {
+                    printf("Error: SAL executed with invalid immediate value %d (valid range is 0-63)\n", imm);
+                }
+                break;
+            case 0x09: // SAR
+                if (imm >= 0 && imm <= 63) {
+                    result = cpu->registers[rd] >> imm;
+                    cpu->registers[rd] = result;
+                    update_status_register(cpu, result, rd, 0);
+                } else {
+                    printf("Error: SAR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
+                }
+                break;
+            case 0x0A: // LDR
+                if (imm >= 0 && imm <= 63) {
+                    if (cpu->dcache.size > 0) {
+                        hold_for_memory(cpu, dcache_access(cpu, imm, false));
+                    }
+                    result = cpu->data_memory[imm];
+                    cpu->registers[rd] = result;
+                    update_status_register(cpu, result, rd, 0);
+                    SIM_HOOK(cpu, on_memory, index, imm, (uint8_t)result, false);
+                } else {
+                    printf("Error: LDR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
+                }
+                break;
+            case 0x0B: // STR
+                if (imm >= 0 && imm <= 63) {
+                    if (cpu->dcache.size > 0) {
+                        hold_for_memory(cpu, dcache_access(cpu, imm, true));
+                    }
+                    mark_data_dirty(cpu, imm);
+                    cpu->data_memory[imm] = cpu->registers[rd];
+                    if (cpu->shared_stores) {
+                        cpu->shared_stores->written |= 1ull << imm;
+                        cpu->shared_stores->values[imm] = cpu->registers[rd];
+                    }
+                    SIM_HOOK(cpu, on_memory, index, imm, cpu->data_memory[imm], true);
+                } else {
+                    printf("Error: STR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
+                }
+                break;
+            case HALT_OPCODE:
+                LOG(cpu, LOG_DELTA, "HALT: stopping the pipeline\n");
+                cpu->halted = true;
+                cpu->registers[64] = branch_base_pc(cpu, index); // Undo wrong-path fetches
+                break;
+            default:
+                printf("Error: Unknown opcode 0x%X\n", opcode);
+                break;
+        }
+
+        if (cpu->trace) {
+            trace_retire(cpu, index, opcode, imm);
+        }
+        SIM_HOOK(cpu, on_retire, index, cpu->instruction_memory[index].current_Instruction);
+        cpu->retired_count++;
+        cpu->IDEX.isempty = 1;
+        if (cpu->stall_flag != 1) {
+            LOG(cpu, LOG_DELTA, "Executed Instruction %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X\n",
+                   cpu->IDEX.inst_number, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate);
+        }
+    }
+}
+
+// Functional-mode handlers. Each one applies the same architectural update as the matching
+// case in execute() and returns the micro-op that runs next, or NULL to halt.
+// Every micro-op that stands for a real instruction counts itself as retired at its PC
+static inline void retire_uop(CPU *cpu, const MicroOp *op) {
+    cpu->retired_count++;
+    cpu->counters.pc_executed[op - cpu->uops]++;
+}
+
+static const MicroOp *uop_add(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] + cpu->registers[op->rs1];
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, op->rs1);
+    return op + 1;
+}
+
+static const MicroOp *uop_sub(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] - cpu->registers[op->rs1];
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, op->rs1);
+    return op + 1;
+}
+
+static const MicroOp *uop_mul(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] * cpu->registers[op->rs1];
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, op->rs1);
+    return op + 1;
+}
+
+static const MicroOp *uop_movi(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    cpu->registers[op->rd] = op->immediate;
+    update_status_register(cpu, op->immediate, op->rd, 0);
+    return op + 1;
+}
+
+// Continue at the instruction the PC now points to, or halt if it left the program
+static const MicroOp *uop_jump(CPU *cpu) {
+    int8_t pc = cpu->registers[64];
+    if (pc < 0 || pc >= cpu->instruction_count) {
+        return NULL;
+    }
+    return &cpu->uops[pc];
+}
+
+// PC value seen by execute() for this instruction: the pipeline has fetched one more (if there was one)
+static int8_t pipeline_pc_after(const CPU *cpu, const MicroOp *op) {
+    return branch_base_pc(cpu, (int)(op - cpu->uops));
+}
+
+static const MicroOp *uop_beqz(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    if (cpu->registers[op->rd] != 0) {
+        cpu->counters.beqz_not_taken++;
+        return op + 1;
+    }
+    cpu->counters.beqz_taken++;
+    // flush() offsets the branch from the PC the pipeline has reached
+    cpu->registers[64] = pipeline_pc_after(cpu, op);
+    uint8_t imm = op->immediate;
+    uint16_t new_pc = cpu->registers[64] + (imm - 1);
+    cpu->registers[64] = new_pc;
+    return uop_jump(cpu);
+}
+
+static const MicroOp *uop_andi(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] & op->immediate;
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, 0);
+    return op + 1;
+}
+
+static const MicroOp *uop_eor(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] ^ cpu->registers[op->rs1];
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, op->rs1);
+    return op + 1;
+}
+
+static const MicroOp *uop_br(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    uint16_t concat_value = ((uint16_t)cpu->registers[op->rd] << 8) | cpu->registers[op->rs1];
+    uint16_t new_pc = concat_value >> 6;
+    cpu->registers[64] = new_pc - 1; // Same adjustment as flush_BR()
+    return uop_jump(cpu);
+}
+
+static const MicroOp *uop_sal(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] << op->immediate;
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, 0);
+    return op + 1;
+}
+
+static const MicroOp *uop_sar(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->registers[op->rd] >> op->immediate;
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, 0);
+    return op + 1;
+}
+
+static const MicroOp *uop_ldr(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    int8_t result = cpu->data_memory[op->immediate];
+    cpu->registers[op->rd] = result;
+    update_status_register(cpu, result, op->rd, 0);
+    return op + 1;
+}
+
+static const MicroOp *uop_str(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    mark_data_dirty(cpu, op->immediate);
+    cpu->data_memory[op->immediate] = cpu->registers[op->rd];
+    return op + 1;
+}
+
+// A zero word is never decoded by the pipeline (decode() treats it as an empty IFID)
+static const MicroOp *uop_nop(CPU *cpu, const MicroOp *op) {
+    (void)cpu;
+    return op + 1;
+}
+
+static const MicroOp *uop_invalid(CPU *cpu, const MicroOp *op) {
+    (void)cpu;
+    printf("Error: Unknown opcode 0x%X\n", op->opcode);
+    return op + 1;
+}
+
+static const MicroOp *uop_halt(CPU *cpu, const MicroOp *op) {
+    retire_uop(cpu, op);
+    cpu->halted = true;
+    cpu->registers[64] = pipeline_pc_after(cpu, op);
+    return NULL;
+}
+
+// Sentinel placed after the last instruction: the pipeline stops fetching with PC = instruction_count
+static const MicroOp *uop_end(CPU *cpu, const MicroOp *op) {
+    (void)op;
+    cpu->registers[64] = cpu->instruction_count;
+    return NULL;
+}
+
+void predecode_program(CPU *cpu) {
+    static const UopHandler handlers[16] = {
+        uop_add, uop_sub, uop_mul, uop_movi, uop_beqz, uop_andi, uop_eor, uop_br,
+        uop_sal, uop_sar, uop_ldr, uop_str, uop_invalid, uop_invalid, uop_invalid, uop_halt
+    };
+
+    for (int i = 0; i < cpu->instruction_count; i++) {
+        uint16_t instruction = cpu->instruction_memory[i].current_Instruction;
+        MicroOp *op = &cpu->uops[i];
+
+        // Field extraction mirrors decode()
+        op->opcode = (instruction >> 12) & 0xF;
+        op->rd = (instruction >> 8) & 0xF;
+        op->rs1 = 0;
+        op->immediate = 0;
+        switch (op->opcode) {
+            case 0x00: // ADD
+            case 0x01: // SUB
+            case 0x02: // MUL
+            case 0x06: // EOR
+            case 0x07: // BR
+                op->rs1 = (instruction >> 4) & 0xF;
+                break;
+            case 0x03: // MOVI
+            case 0x04: // BEQZ
+                op->immediate = instruction & 0x3F;
+                if (op->immediate & 0x20) { // Sign extend
+                    op->immediate |= 0xC0;
+                }
+                break;
+            case 0x05: // ANDI
+            case 0x08: // SAL
+            case 0x09: // SAR
+            case 0x0A: // LDR
+            case 0x0B: // STR
+                op->immediate = instruction & 0x3F;
+                break;
+            default:
+                break;
+        }
+        op->handler = instruction == 0 ? uop_nop : handlers[op->opcode];
+    }
+
+    cpu->uops[cpu->instruction_count] = (MicroOp){ .handler = uop_end };
+}
+
+void run_functional(CPU *cpu) {
+    // Call-threaded dispatch: no per-instruction decode and no IFID/IDEX traffic. Architectural
+    // results match run_pipeline(); max_cycles bounds the number of dispatched instructions.
+    double start = host_time();
+    const MicroOp *op = &cpu->uops[0];
+    if (cpu->max_cycles > 0) {
+        long budget = cpu->max_cycles;
+        while (op && budget-- > 0) {
+            op = op->handler(cpu, op);
+        }
+        if (op) {
+            LOG(cpu, LOG_SUMMARY, "Instruction budget of %ld exhausted, stopping the run\n", cpu->max_cycles);
+        }
+    } else {
+        while (op) {
+            op = op->handler(cpu, op);
+        }
+    }
+    cpu->host_seconds = host_time() - start;
+
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->counters_file) {
+        write_perf_counters(cpu, cpu->counters_file, "functional");
+    }
+}
+
+#ifdef JIT_SUPPORTED
+// Machine code for the translated blocks. While native code runs, rbx points at R0, r13 at data memory,
+// r14 at the CPU, r15 at the block counters, rbp at the translation cache and r12 holds the budget.
+static void jit_bytes(Jit *jit, int count, ...) {
+    va_list bytes;
+    va_start(bytes, count);
+    for (int i = 0; i < count; i++) {
+        jit->code[jit->used++] = (uint8_t)va_arg(bytes, int);
+    }
+    va_end(bytes);
+}
+
+static void jit_u32(Jit *jit, uint32_t value) {
+    put_u32(jit->code + jit->used, value);
+    jit->used += 4;
+}
+
+// rel32 operand at site so that the jump lands on target
+static void jit_patch(Jit *jit, size_t site, size_t target) {
+    put_u32(jit->code + site, (uint32_t)(target - (site + 4)));
+}
+
+static void jit_jump(Jit *jit, size_t target) {
+    jit_bytes(jit, 1, 0xE9);                  // jmp rel32
+    jit_u32(jit, 0);
+    jit_patch(jit, jit->used - 4, target);
+}
+
+// Leave native code with eax = PC to continue at (-1: the program has ended)
+static void jit_exit(Jit *jit, int pc) {
+    jit_bytes(jit, 1, 0xB8);                  // mov eax, pc
+    jit_u32(jit, (uint32_t)pc);
+    jit_jump(jit, jit->exit);
+}
+
+// Continue at the block for pc: a direct jump once it is translated, until then an exit whose
+// jump jit_translate() redirects when the block appears
+static void jit_chain(Jit *jit, int pc) {
+    if (jit->entries[pc]) {
+        jit_jump(jit, jit->entries[pc] - jit->code);
+        return;
+    }
+    jit_bytes(jit, 1, 0xE9);                  // jmp rel32 to the exit right behind it
+    jit_u32(jit, 0);
+    if (jit->link_count < JIT_MAX_LINKS) {
+        jit->links[jit->link_count].site = jit->used - 4;
+        jit->links[jit->link_count].target = pc;
+        jit->link_count++;
+    }
+    jit_exit(jit, pc);
+}
+
+static void jit_load_register(Jit *jit, bool ecx, uint8_t reg) {
+    jit_bytes(jit, 4, 0x0F, 0xBE, ecx ? 0x4B : 0x43, reg); // movsx eax/ecx, byte [rbx + reg]
+}
+
+static void jit_store_register(Jit *jit, uint8_t reg) {
+    jit_bytes(jit, 3, 0x88, 0x43, reg);       // mov [rbx + reg], al
+}
+
+static void jit_store_cpu_byte(Jit *jit, bool ecx, size_t offset) {
+    jit_bytes(jit, 3, 0x41, 0x88, ecx ? 0x8E : 0x86); // mov [r14 + offset], al/cl
+    jit_u32(jit, (uint32_t)offset);
+}
+
+static void jit_increment_counter(Jit *jit, size_t offset) {
+    jit_bytes(jit, 3, 0x49, 0xFF, 0x87);      // inc qword [r15 + offset]
+    jit_u32(jit, (uint32_t)offset);
+}
+
+static bool jit_translatable(const CPU *cpu, int pc) {
+    const MicroOp *op = &cpu->uops[pc];
+    return pc < cpu->instruction_count && op->handler != uop_halt && op->handler != uop_invalid;
+}
+
+static bool jit_sets_flags(const MicroOp *op) {
+    return op->handler != uop_nop && op->opcode != 0x04 && op->opcode != 0x07 && op->opcode != 0x0B;
+}
+
+// Entry trampoline jit_enter(cpu, code, &budget, counters, entries) and the exit it returns through
+static void jit_emit_trampoline(Jit *jit) {
+    jit_bytes(jit, 11, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x52); // push rbx..r15, rdx
+    jit_bytes(jit, 3, 0x49, 0x89, 0xFE);      // mov r14, rdi
+    jit_bytes(jit, 3, 0x48, 0x8D, 0x9F);      // lea rbx, [rdi + registers]
+    jit_u32(jit, offsetof(CPU, registers));
+    jit_bytes(jit, 3, 0x4C, 0x8D, 0xAF);      // lea r13, [rdi + data_memory]
+    jit_u32(jit, offsetof(CPU, data_memory));
+    jit_bytes(jit, 3, 0x4C, 0x8B, 0x22);      // mov r12, [rdx]
+    jit_bytes(jit, 3, 0x49, 0x89, 0xCF);      // mov r15, rcx
+    jit_bytes(jit, 3, 0x4C, 0x89, 0xC5);      // mov rbp, r8
+    jit_bytes(jit, 2, 0xFF, 0xE6);            // jmp rsi
+
+    jit->exit = jit->used;
+    jit_bytes(jit, 4, 0x59, 0x4C, 0x89, 0x21); // pop rcx; mov [rcx], r12
+    jit_bytes(jit, 11, 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3); // pop r15..rbx; ret
+}
+
+static Jit *jit_create(void) {
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit) return NULL;
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    jit_emit_trampoline(jit);
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->code, JIT_CODE_SIZE);
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+static void jit_destroy(Jit *jit) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+// Native code for the block starting at pc: straight-line micro-ops up to and including a BEQZ or BR,
+// stopping in front of HALT, an undecodable word or the end of the program. Registers are read and
+// written in place; SREG operands are stored only after the block's last flag-setting instruction.
+// Returns NULL when pc cannot start a block, or the code buffer is full, and the caller interprets.
+static const uint8_t *jit_translate(Jit *jit, const CPU *cpu, int pc) {
+    if (!jit_translatable(cpu, pc) || jit->used + JIT_BLOCK_BYTES > JIT_CODE_SIZE) return NULL;
+
+    JitBlock *block = &jit->blocks[pc];
+    int last_flags = -1;
+    block->length = 0;
+    block->retired = 0;
+    while (pc + block->length < cpu->instruction_count && block->length < JIT_MAX_BLOCK &&
+           jit_translatable(cpu, pc + block->length)) {
+        const MicroOp *op = &cpu->uops[pc + block->length++];
+        block->retired += op->handler != uop_nop;
+        if (jit_sets_flags(op)) last_flags = pc + block->length - 1;
+        if (op->handler == uop_beqz || op->handler == uop_br) break;
+    }
+    block->ends_in_beqz = cpu->uops[pc + block->length - 1].handler == uop_beqz;
+
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) return NULL;
+    const uint8_t *entry = jit->code + jit->used;
+    size_t counter = pc * sizeof(JitCounter);
+    jit_bytes(jit, 3, 0x49, 0x81, 0xFC);      // cmp r12, length
+    jit_u32(jit, block->length);
+    jit_bytes(jit, 2, 0x0F, 0x82);            // jb bail
+    size_t bail = jit->used;
+    jit_u32(jit, 0);
+    jit_bytes(jit, 3, 0x49, 0x81, 0xEC);      // sub r12, length
+    jit_u32(jit, block->length);
+    jit_increment_counter(jit, counter + offsetof(JitCounter, executions));
+
+    bool stored = false;
+    for (int i = pc; i < pc + block->length; i++) {
+        const MicroOp *op = &cpu->uops[i];
+        uint8_t rd = op->rd, rs = op->rs1;
+        if (op->handler == uop_nop) continue;
+        switch (op->opcode) {
+            case 0x00: // ADD
+            case 0x01: // SUB
+            case 0x02: // MUL
+            case 0x06: // EOR
+                jit_load_register(jit, false, rd);
+                jit_load_register(jit, true, rs);
+                if (op->opcode == 0x00) jit_bytes(jit, 2, 0x01, 0xC8);       // add eax, ecx
+                if (op->opcode == 0x01) jit_bytes(jit, 2, 0x29, 0xC8);       // sub eax, ecx
+                if (op->opcode == 0x02) jit_bytes(jit, 3, 0x0F, 0xAF, 0xC1); // imul eax, ecx
+                if (op->opcode == 0x06) jit_bytes(jit, 2, 0x31, 0xC8);       // xor eax, ecx
+                jit_store_register(jit, rd);
+                break;
+            case 0x03: // MOVI
+                jit_bytes(jit, 1, 0xB8);              // mov eax, immediate
+                jit_u32(jit, (uint32_t)(int32_t)op->immediate);
+                jit_store_register(jit, rd);
+                break;
+            case 0x05: // ANDI
+                jit_load_register(jit, false, rd);
+                jit_bytes(jit, 1, 0x25);              // and eax, immediate
+                jit_u32(jit, (uint32_t)op->immediate);
+                jit_store_register(jit, rd);
+                break;
+            case 0x08: // SAL
+            case 0x09: // SAR
+                // 32-bit shifts take the count modulo 32, as the int shifts in execute() do on this host
+                jit_load_register(jit, false, rd);
+                jit_bytes(jit, 3, 0xC1, op->opcode == 0x08 ? 0xE0 : 0xF8, (uint8_t)op->immediate); // shl/sar eax
+                jit_store_register(jit, rd);
+                break;
+            case 0x0A: // LDR
+                jit_bytes(jit, 5, 0x41, 0x0F, 0xBE, 0x45, (uint8_t)op->immediate); // movsx eax, byte [r13 + imm]
+                jit_store_register(jit, rd);
+                break;
+            case 0x0B: // STR
+                jit_load_register(jit, false, rd);
+                jit_bytes(jit, 4, 0x41, 0x88, 0x45, (uint8_t)op->immediate);       // mov [r13 + imm], al
+                if (!stored) {
+                    jit_bytes(jit, 3, 0x41, 0x83, 0x8E); // or dword [r14 + dirty_data_lines], bit
+                    jit_u32(jit, offsetof(CPU, dirty_data_lines));
+                    jit_bytes(jit, 1, 1 << (op->immediate / DATA_DIRTY_LINE));
+                    stored = true;
+                }
+                break;
+            case 0x04: { // BEQZ: taken exits leave through a chained jump
+                int8_t base = branch_base_pc(cpu, i);
+                uint8_t imm = op->immediate;
+                int8_t target = (uint16_t)(base + (imm - 1)); // As uop_beqz() computes it
+                jit_bytes(jit, 4, 0x80, 0x7B, rd, 0x00);   // cmp byte [rbx + rd], 0
+                jit_bytes(jit, 2, 0x0F, 0x85);             // jne not_taken
+                size_t not_taken = jit->used;
+                jit_u32(jit, 0);
+                jit_increment_counter(jit, counter + offsetof(JitCounter, taken));
+                jit_bytes(jit, 4, 0xC6, 0x43, 64, (uint8_t)target); // mov byte [rbx + 64], target
+                if (target >= 0 && target < cpu->instruction_count) {
+                    jit_chain(jit, target);
+                } else {
+                    jit_exit(jit, -1);
+                }
+                jit_patch(jit, not_taken, jit->used);
+                break;
+            }
+            case 0x07: // BR: the target is only known at run time, so look it up in the translation cache
+                jit_load_register(jit, false, rd);
+                jit_bytes(jit, 3, 0xC1, 0xE0, 8);          // shl eax, 8
+                jit_load_register(jit, true, rs);
+                jit_bytes(jit, 2, 0x09, 0xC8);             // or eax, ecx
+                jit_bytes(jit, 3, 0x0F, 0xB7, 0xC0);       // movzx eax, ax
+                jit_bytes(jit, 3, 0xC1, 0xE8, 6);          // shr eax, 6
+                jit_bytes(jit, 2, 0xFF, 0xC8);             // dec eax
+                jit_store_register(jit, 64);
+                jit_bytes(jit, 3, 0x0F, 0xBE, 0xC0);       // movsx eax, al
+                jit_bytes(jit, 1, 0x3D);                   // cmp eax, instruction_count
+                jit_u32(jit, cpu->instruction_count);
+                jit_bytes(jit, 2, 0x0F, 0x83);             // jae ended
+                size_t ended = jit->used;
+                jit_u32(jit, 0);
+                jit_bytes(jit, 5, 0x48, 0x8B, 0x4C, 0xC5, 0x00); // mov rcx, [rbp + rax * 8]
+                jit_bytes(jit, 3, 0x48, 0x85, 0xC9);       // test rcx, rcx
+                jit_bytes(jit, 2, 0x0F, 0x84);             // jz exit (eax holds the PC)
+                jit_u32(jit, 0);
+                jit_patch(jit, jit->used - 4, jit->exit);
+                jit_bytes(jit, 2, 0xFF, 0xE1);             // jmp rcx
+                jit_patch(jit, ended, jit->used);
+                jit_exit(jit, -1);
+                break;
+        }
+
+        if (i == last_flags) {
+            // update_status_register() operands: the result, RD after the write and RS (R0 for immediates)
+            uint8_t flags_rs = op->opcode <= 0x02 || op->opcode == 0x06 ? rs : 0;
+            jit_store_cpu_byte(jit, false, offsetof(CPU, flags) + offsetof(LazyFlags, result));
+            jit_store_cpu_byte(jit, false, offsetof(CPU, flags) + offsetof(LazyFlags, rd_value));
+            if (flags_rs != rd) {
+                jit_load_register(jit, true, flags_rs);
+            }
+            jit_store_cpu_byte(jit, flags_rs != rd, offsetof(CPU, flags) + offsetof(LazyFlags, rs_value));
+            jit_bytes(jit, 3, 0x41, 0xC6, 0x86);  // mov byte [r14 + pending], 1
+            jit_u32(jit, offsetof(CPU, flags) + offsetof(LazyFlags, pending));
+            jit_bytes(jit, 1, 1);
+        }
+    }
+    if (cpu->uops[pc + block->length - 1].handler != uop_br) {
+        jit_chain(jit, pc + block->length); // Fall through, also after a BEQZ that was not taken
+    }
+
+    // Not enough budget for the whole block: give it back to the interpreter
+    jit_patch(jit, bail, jit->used);
+    jit_exit(jit, pc);
+
+    jit->entries[pc] = entry;
+    for (int i = 0; i < jit->link_count; i++) {
+        if (jit->links[i].target != pc) continue;
+        jit_patch(jit, jit->links[i].site, entry - jit->code);
+        jit->links[i--] = jit->links[--jit->link_count];
+    }
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        printf("Error: Unable to make translated code executable\n");
+        exit(1);
+    }
+    return entry;
+}
+#endif
+
+// Functional execution through translated basic blocks. Architectural results, counters and the
+// instruction budget match run_functional(); HALT, undecodable words and the last micro-ops of a
+// budget go through the micro-op handlers.
+void run_jit(CPU *cpu) {
+#ifdef JIT_SUPPORTED
+    double start = host_time();
+    Jit *jit = jit_create();
+    if (!jit) {
+        printf("Error: Unable to map memory for translated code, running the functional core instead\n");
+        run_functional(cpu);
+        return;
+    }
+    JitEntry enter = (JitEntry)(void *)jit->code;
+
+    long budget = cpu->max_cycles > 0 ? cpu->max_cycles : LONG_MAX;
+    int pc = 0;
+    while (pc >= 0 && budget > 0) {
+        const uint8_t *code = jit->entries[pc] ? jit->entries[pc] : jit_translate(jit, cpu, pc);
+        if (code && jit->blocks[pc].length <= budget) {
+            pc = enter(cpu, code, &budget, jit->counters, jit->entries);
+            continue;
+        }
+        if (!cpu->lazy_flags) {
+            read_status_register(cpu); // Translated blocks always leave SREG pending
+        }
+        const MicroOp *op = cpu->uops[pc].handler(cpu, &cpu->uops[pc]);
+        budget--;
+        pc = op ? (int)(op - cpu->uops) : -1;
+    }
+    if (pc >= 0) {
+        LOG(cpu, LOG_SUMMARY, "Instruction budget of %ld exhausted, stopping the run\n", cpu->max_cycles);
+    }
+
+    // Blocks counted their runs; spread them over the instructions as the handlers would have
+    for (int b = 0; b < cpu->instruction_count; b++) {
+        const JitCounter *counter = &jit->counters[b];
+        if (counter->executions == 0) continue;
+        for (int i = b; i < b + jit->blocks[b].length; i++) {
+            if (cpu->uops[i].handler != uop_nop) cpu->counters.pc_executed[i] += counter->executions;
+        }
+        cpu->retired_count += counter->executions * jit->blocks[b].retired;
+        if (jit->blocks[b].ends_in_beqz) {
+            cpu->counters.beqz_taken += counter->taken;
+            cpu->counters.beqz_not_taken += counter->executions - counter->taken;
+        }
+    }
+    if (!cpu->lazy_flags) {
+        read_status_register(cpu);
+    }
+    jit_destroy(jit);
+    cpu->host_seconds = host_time() - start;
+
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->counters_file) {
+        write_perf_counters(cpu, cpu->counters_file, "jit");
+    }
+#else
+    run_functional(cpu);
+#endif
+}
+
+// Functional execution from op for at most steps instructions, stopping early in front of stop_pc.
+// Returns the micro-op that runs next, NULL once the program has ended.
+static const MicroOp *fast_forward(CPU *cpu, const MicroOp *op, long steps, int stop_pc) {
+    long start = cpu->retired_count;
+    while (op && steps-- > 0 && op - cpu->uops != stop_pc) {
+        op = op->handler(cpu, op);
+    }
+    cpu->fast_forwarded += cpu->retired_count - start;
+    return op;
+}
+
+// Hand the architectural state over to the detailed pipeline: empty latches, fetch starts at op.
+// Nothing else needs converting, because branch targets and HALT's PC depend only on the index.
+static void enter_pipeline(CPU *cpu, const MicroOp *op) {
+    cpu->registers[64] = (int8_t)(op - cpu->uops);
+    cpu->IFID.instruction = 0;
+    cpu->IFID.inst_number = 0;
+    cpu->IFID.predicted = false;
+    erase_IDEX(cpu);
+    cpu->stall_flag = 0;
+    cpu->decode_stalled = false;
+    cpu->written_reg = -1;
+    cpu->memory_stall = 0;
+}
+
+// Back to the functional core: the oldest instruction still in a latch is the next one to run.
+// Returns NULL if the pipeline has run past the end of the program.
+static const MicroOp *leave_pipeline(CPU *cpu) {
+    int next = cpu->registers[64];
+    if (!cpu->IDEX.isempty) {
+        next = cpu->IDEX.inst_number - 1;
+    } else if (cpu->IFID.instruction != 0) {
+        next = cpu->IFID.inst_number - 1;
+    }
+    cpu->IFID.instruction = 0;
+    cpu->IFID.predicted = false;
+    erase_IDEX(cpu);
+    if (next < 0 || next >= cpu->instruction_count) return NULL;
+    cpu->registers[64] = next;
+    return &cpu->uops[next];
+}
+
+// Detailed cycles until `instructions` more have retired (0 = until the program ends) and no
+// access is left in the data cache. Returns false once the program has ended or the budget is spent.
+static bool run_pipeline_region(CPU *cpu, long instructions, long *steps) {
+    long target = cpu->retired_count + instructions;
+    while (!cpu->halted && !pipeline_drained(cpu)) {
+        if (instructions > 0 && cpu->retired_count >= target && cpu->memory_stall == 0) return true;
+        if (cpu->max_cycles > 0 && *steps >= cpu->max_cycles) return false;
+        pipeline_cycle(cpu);
+        (*steps)++;
+    }
+    return false;
+}
+
+// Sampling: fast-forward functionally, warm up and measure in the detailed pipeline, then fast-forward
+// again to the next sample. Only the measured regions count towards the sampled CPI. max_cycles
+// bounds functional instructions and detailed cycles together.
+void run_sampled(CPU *cpu, const RunOptions *options) {
+    double start = host_time();
+    const MicroOp *op = &cpu->uops[0];
+    long steps = 0;
+    long skip = options->fast_forward > 0 ? options->fast_forward : (options->fast_forward_pc >= 0 ? LONG_MAX : 0);
+
+    read_status_register(cpu);
+    while (op) {
+        long budget = cpu->max_cycles > 0 ? cpu->max_cycles - steps : LONG_MAX;
+        long before = cpu->fast_forwarded;
+        op = fast_forward(cpu, op, skip < budget ? skip : budget, cpu->samples == 0 ? options->fast_forward_pc : -1);
+        steps += cpu->fast_forwarded - before;
+        if (!op || (cpu->max_cycles > 0 && steps >= cpu->max_cycles)) break;
+
+        LOG(cpu, LOG_SUMMARY, "Sample %d: detailed simulation from PC %d after %ld instructions\n", cpu->samples + 1,
+            (int)(op - cpu->uops), cpu->retired_count);
+        enter_pipeline(cpu, op);
+        memcpy(cpu->logged_registers, cpu->registers, sizeof(cpu->registers));
+        memcpy(cpu->logged_data_memory, cpu->data_memory, sizeof(cpu->data_memory));
+        bool running = options->warmup == 0 || run_pipeline_region(cpu, options->warmup, &steps);
+        long cycles = cpu->cycle_count, retired = cpu->retired_count;
+        if (running) {
+            running = run_pipeline_region(cpu, options->measure, &steps);
+        }
+        cpu->samples++;
+        cpu->measured_cycles += cpu->cycle_count - cycles;
+        cpu->measured_instructions += cpu->retired_count - retired;
+        LOG(cpu, LOG_SUMMARY, "Sample %d: %ld instructions in %ld cycles\n", cpu->samples,
+            cpu->retired_count - retired, cpu->cycle_count - cycles);
+        if (!running || cpu->halted) break;
+
+        op = leave_pipeline(cpu);
+        skip = options->sample_every > 0 ? options->sample_every : LONG_MAX;
+    }
+    if (cpu->max_cycles > 0 && steps >= cpu->max_cycles) {
+        LOG(cpu, LOG_SUMMARY, "Budget of %ld instructions and cycles exhausted, stopping the run\n", cpu->max_cycles);
+    }
+    cpu->host_seconds = host_time() - start;
+
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->counters_file) {
+        write_perf_counters(cpu, cpu->counters_file, "sampled");
+    }
+}
+
+// xorshift64*: fast, and a seed reproduces a whole fuzzing session
+static uint64_t fuzz_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// A program the assembler could have produced, with an occasional HALT. Registers lean towards
+// R0-R3 so that back-to-back dependences, and so the hazard logic, come up often.
+static void fuzz_generate(FuzzCase *fuzz_case, uint64_t *state) {
+    fuzz_case->length = 1 + (int)(fuzz_random(state) % FUZZ_MAX_LENGTH);
+    for (int i = 0; i < fuzz_case->length; i++) {
+        uint64_t bits = fuzz_random(state);
+        uint8_t opcode = bits % 32 == 0 ? HALT_OPCODE : (bits >> 5) % 12;
+        uint8_t rd = (bits >> 9) & 3 ? (bits >> 11) & 3 : (bits >> 13) & 0xF;
+        uint8_t rs = (bits >> 17) & 3 ? (bits >> 19) & 3 : (bits >> 21) & 0xF;
+        uint16_t word = opcode << 12;
+        if (opcode != HALT_OPCODE) {
+            word |= rd << 8;
+            word |= find_opcode(opcode)->format == FORMAT_RR ? (uint16_t)(rs << 4) : (uint16_t)((bits >> 25) & 0x3F);
+        }
+        fuzz_case->words[i] = word;
+    }
+    for (int i = 0; i < FUZZ_DATA_BYTES; i += 8) {
+        uint64_t bits = fuzz_random(state);
+        for (int k = 0; k < 8; k++, bits >>= 8) {
+            fuzz_case->data[i + k] = (bits & 3) == 0 ? 0 : (uint8_t)(bits >> 2) * 7; // A quarter are zero
+        }
+    }
+}
+
+_Static_assert(FUZZ_DATA_BYTES <= DATA_DIRTY_LINE, "fuzz_load() marks a single dirty line");
+
+static void fuzz_load(CPU *cpu, const CPU *template, const FuzzCase *fuzz_case) {
+    reset_cpu(cpu, template);
+    for (int i = 0; i < fuzz_case->length; i++) {
+        cpu->instruction_memory[i].current_Instruction = fuzz_case->words[i];
+    }
+    cpu->instruction_count = fuzz_case->length;
+    predecode_program(cpu);
+    memcpy(cpu->data_memory, fuzz_case->data, FUZZ_DATA_BYTES);
+    mark_data_dirty(cpu, 0);
+}
+
+// Compares a finished run against the reference; on a difference describes the first one in report
+static int fuzz_compare(const CPU *cpu, const CPU *reference, const char *core, char *report, size_t report_size) {
+    if (memcmp(cpu->registers, reference->registers, sizeof(cpu->registers)) == 0 &&
+        memcmp(cpu->data_memory, reference->data_memory, sizeof(cpu->data_memory)) == 0) {
+        return FUZZ_MATCH;
+    }
+    if (!report) return FUZZ_DIVERGED;
+
+    for (int i = 0; i < REGISTER_COUNT; i++) {
+        if (cpu->registers[i] == reference->registers[i]) continue;
+        char name[8];
+        snprintf(name, sizeof(name), i == 64 ? "PC" : i == 65 ? "SREG" : "R%d", i);
+        snprintf(report, report_size, "%s is %d on the %s and %d on the reference", name, cpu->registers[i], core,
+                 reference->registers[i]);
+        return FUZZ_DIVERGED;
+    }
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+        if (cpu->data_memory[i] == reference->data_memory[i]) continue;
+        snprintf(report, report_size, "data_memory[%d] is %d on the %s and %d on the reference", i, cpu->data_memory[i],
+                 core, reference->data_memory[i]);
+        break;
+    }
+    return FUZZ_DIVERGED;
+}
+
+// Runs one case on the functional core, then on the lockstep engine, the JIT and the detailed pipeline. Returns
+// FUZZ_*, and for FUZZ_DIVERGED describes the first difference in report when one is given.
+static int fuzz_run(CPU *pipeline, CPU *reference, LockstepGroup *group, const CPU *template, const FuzzCase *fuzz_case,
+                    char *report, size_t report_size) {
+    fuzz_load(reference, template, fuzz_case);
+    const MicroOp *op = &reference->uops[0];
+    long steps = 0;
+    while (op && steps < FUZZ_MAX_STEPS) {
+        op = op->handler(reference, op);
+        steps++;
+    }
+    if (op) return FUZZ_SKIPPED;
+    read_status_register(reference);
+
+    fuzz_load(pipeline, template, fuzz_case);
+    run_lockstep_lane(group, pipeline, pipeline, FUZZ_MAX_STEPS);
+    if (fuzz_compare(pipeline, reference, "lockstep engine", report, report_size) != FUZZ_MATCH) {
+        return FUZZ_DIVERGED;
+    }
+#ifdef JIT_SUPPORTED
+    fuzz_load(pipeline, template, fuzz_case);
+    pipeline->max_cycles = FUZZ_MAX_STEPS;
+    run_jit(pipeline);
+    read_status_register(pipeline);
+    if (fuzz_compare(pipeline, reference, "JIT", report, report_size) != FUZZ_MATCH) {
+        return FUZZ_DIVERGED;
+    }
+#endif
+
+    fuzz_load(pipeline, template, fuzz_case);
+    const DataCache *cache = &pipeline->dcache;
+    long budget = (steps + 2) * (FUZZ_CYCLES_PER_STEP + (cache->size > 0 ? cache->hit_latency + 2 * cache->miss_latency : 0));
+    while (!pipeline->halted && !pipeline_drained(pipeline)) {
+        if (pipeline->cycle_count >= budget) {
+            if (report) snprintf(report, report_size, "the pipeline was still running after %ld cycles", budget);
+            return FUZZ_DIVERGED;
+        }
+        pipeline_cycle(pipeline);
+    }
+
+    read_status_register(pipeline);
+    return fuzz_compare(pipeline, reference, "pipeline", report, report_size);
+}
+
+// Shrinks a diverging case for as long as it keeps diverging: drops runs of instructions, halving the
+// run length down to single instructions, then clears the initial data bytes one at a time
+static void fuzz_minimize(CPU *pipeline, CPU *reference, LockstepGroup *group, const CPU *template, FuzzCase *fuzz_case) {
+    for (int size = fuzz_case->length / 2; size >= 1; size /= 2) {
+        for (int start = 0; start + size <= fuzz_case->length && fuzz_case->length > size;) {
+            FuzzCase smaller = *fuzz_case;
+            memmove(smaller.words + start, smaller.words + start + size,
+                    (smaller.length - start - size) * sizeof(smaller.words[0]));
+            smaller.length -= size;
+            if (fuzz_run(pipeline, reference, group, template, &smaller, NULL, 0) == FUZZ_DIVERGED) {
+                *fuzz_case = smaller;
+            } else {
+                start += size;
+            }
+        }
+    }
+    for (int i = 0; i < FUZZ_DATA_BYTES; i++) {
+        if (fuzz_case->data[i] == 0) continue;
+        FuzzCase smaller = *fuzz_case;
+        smaller.data[i] = 0;
+        if (fuzz_run(pipeline, reference, group, template, &smaller, NULL, 0) == FUZZ_DIVERGED) {
+            *fuzz_case = smaller;
+        }
+    }
+}
+
+// The case as assembler source that load_program() reads back
+static void print_fuzz_case(const FuzzCase *fuzz_case) {
+    for (int i = 0; i < fuzz_case->length; i++) {
+        uint16_t word = fuzz_case->words[i];
+        const OpcodeInfo *info = find_opcode(word >> 12);
+        int rd = (word >> 8) & 0xF, rs = (word >> 4) & 0xF, imm = word & 0x3F;
+        switch (info->format) {
+            case FORMAT_RR: printf("    %s R%d, R%d\n", info->mnemonic, rd, rs); break;
+            case FORMAT_SIGNED: printf("    %s R%d, %d\n", info->mnemonic, rd, imm & 0x20 ? imm - 64 : imm); break;
+            case FORMAT_UNSIGNED: printf("    %s R%d, %d\n", info->mnemonic, rd, imm); break;
+            default: printf("    %s\n", info->mnemonic); break;
+        }
+    }
+
+    int used = FUZZ_DATA_BYTES;
+    while (used > 0 && fuzz_case->data[used - 1] == 0) used--;
+    if (used > 0) {
+        printf("    .data 0");
+        for (int i = 0; i < used; i++) {
+            printf(", %d", fuzz_case->data[i]);
+        }
+        printf("\n");
+    }
+}
+
+// Differential fuzzing of run_pipeline()'s machine, the lockstep engine and the JIT against the functional core,
+// all in memory: each case is generated into a CPU reset from a template, so no files or processes are
+// involved. Stops at the first divergence and prints it minimized.
+int run_fuzz(const RunOptions *options, long cases, uint64_t seed) {
+    CPU *cpus = malloc(3 * sizeof(CPU));
+    LockstepGroup *group = lockstep_alloc(sizeof(LockstepGroup));
+    if (!cpus || !group) {
+        printf("Error: Out of memory\n");
+        free(cpus);
+        lockstep_free(group);
+        return 1;
+    }
+    CPU *template = &cpus[0], *pipeline = &cpus[1], *reference = &cpus[2];
+    RunOptions fuzz_options = *options;
+    fuzz_options.log_level = LOG_SILENT;
+    fuzz_options.counters_file = NULL;
+    fuzz_options.trace_file = NULL;
+    fuzz_options.checkpoint_every = 0;
+    initialize_cpu(template);
+    apply_run_options(template, &fuzz_options);
+    template->instruction_count = FUZZ_MAX_LENGTH; // So reset_cpu() clears the per-PC counters of any case
+    memcpy(pipeline, template, sizeof(CPU));
+    memcpy(reference, template, sizeof(CPU));
+
+#ifdef JIT_SUPPORTED
+    const char *cores = "the pipeline, the lockstep engine and the JIT";
+#else
+    const char *cores = "the pipeline and the lockstep engine";
+#endif
+    printf("Fuzzing %s against the functional core: %ld cases from seed %llu\n", cores, cases, (unsigned long long)seed);
+    fflush(stdout);
+    uint64_t state = seed != 0 ? seed : 1; // xorshift never leaves 0
+    long skipped = 0;
+    double start = host_time();
+    for (long n = 1; n <= cases; n++) {
+        FuzzCase fuzz_case;
+        char report[128];
+        fuzz_generate(&fuzz_case, &state);
+        int result = fuzz_run(pipeline, reference, group, template, &fuzz_case, report, sizeof(report));
+        skipped += result == FUZZ_SKIPPED;
+        if (result != FUZZ_DIVERGED) continue;
+
+        printf("Case %ld (%d instructions) diverged: %s\n", n, fuzz_case.length, report);
+        fuzz_minimize(pipeline, reference, group, template, &fuzz_case);
+        fuzz_run(pipeline, reference, group, template, &fuzz_case, report, sizeof(report));
+        printf("Minimized to %d instructions, where %s:\n", fuzz_case.length, report);
+        print_fuzz_case(&fuzz_case);
+        free(cpus);
+        lockstep_free(group);
+        return 1;
+    }
+
+    double elapsed = host_time() - start;
+    printf("No divergence in %ld cases (%ld skipped for running over %d micro-ops) in %.2f s, %.0f cases/s\n", cases,
+           skipped, FUZZ_MAX_STEPS, elapsed, elapsed > 0 ? cases / elapsed : 0.0);
+    free(cpus);
+    lockstep_free(group);
+    return 0;
+}
+
+const PipelineDescription *find_pipeline_description(int depth) {
+    for (size_t i = 0; i < sizeof(pipeline_descriptions) / sizeof(pipeline_descriptions[0]); i++) {
+        if (pipeline_descriptions[i].depth == depth) return &pipeline_descriptions[i];
+    }
+    return NULL;
+}
+
+// Index of the first (or last) stage with the given role, -1 if the pipeline has none
+static int pipeline_stage(const PipelineDescription *pipeline, int role, bool last) {
+    int found = -1;
+    for (int s = 0; s < pipeline->depth; s++) {
+        if (pipeline->stages[s].role != role) continue;
+        found = s;
+        if (!last) break;
+    }
+    return found;
+}
+
+// Give one instruction the earliest cycle in each stage that keeps issue in order, leaves at most
+// `width` instructions per stage, waits for the latch ahead to drain and respects data dependences
+// and fetch redirects. Zero words and undecodable ones only take a fetch slot, as in decode().
+static void model_instruction(CPU *cpu, PipelineModel *model, int index, const MicroOp *op, bool executes, long *t) {
+    const PipelineDescription *pipeline = model->pipeline;
+    const long *older = model->recent[model->oldest];
+    int depth = executes ? pipeline->depth : 1;
+    int operand_stage = cpu->forwarding == FORWARD_NONE ? model->read_stage : model->execute_stage;
+    int regs[2];
+    int sources = executes ? instruction_sources(cpu->instruction_memory[index].current_Instruction, regs) : 0;
+
+    for (int s = 0; s < depth; s++) {
+        long cycle = s == 0 ? model->fetch_ready : t[s - 1] + 1;
+        if (cycle < model->previous[s]) cycle = model->previous[s];
+        if (cycle < older[s] + 1) cycle = older[s] + 1;
+        if (s + 1 < pipeline->depth && cycle < older[s + 1]) cycle = older[s + 1];
+        if (s == operand_stage) {
+            for (int k = 0; k < sources; k++) {
+                long wait = model->ready[regs[k]] - cycle;
+                if (wait <= 0) continue;
+                if (model->ready_load[regs[k]]) {
+                    cpu->counters.load_use_stalls += wait;
+                } else {
+                    cpu->counters.data_stalls += wait;
+                }
+                cpu->counters.pc_stalls[index] += wait;
+                cycle += wait;
+            }
+        }
+        t[s] = cycle;
+    }
+    for (int s = depth; s < pipeline->depth; s++) {
+        t[s] = t[0];
+    }
+
+    if (executes && opcode_writes_rd(op->opcode)) {
+        int result_stage = op->opcode == 0x0A ? model->load_stage : model->execute_stage;
+        model->ready[op->rd] = (cpu->forwarding == FORWARD_NONE ? t[pipeline->depth - 1] : t[result_stage]) + 1;
+        model->ready_load[op->rd] = op->opcode == 0x0A;
+    }
+    memcpy(model->recent[model->oldest], t, sizeof(model->recent[0]));
+    memcpy(model->previous, t, sizeof(model->previous));
+    model->oldest = (model->oldest + 1) % model->width;
+}
+
+// Run the program through the functional micro-ops and time it on a pipeline_descriptions[] entry.
+// Branches resolve in EX and redirect fetch there (static not-taken, no BTB); the 3-stage 1-wide
+// configuration reproduces run_pipeline()'s cycle counts.
+void run_pipeline_model(CPU *cpu, int depth, int width) {
+    double start = host_time();
+    PipelineModel model;
+    memset(&model, 0, sizeof(model));
+    model.pipeline = find_pipeline_description(depth);
+    model.width = width;
+    model.read_stage = pipeline_stage(model.pipeline, STAGE_DECODE, true);
+    model.execute_stage = pipeline_stage(model.pipeline, STAGE_EXECUTE, false);
+    model.load_stage = pipeline_stage(model.pipeline, STAGE_MEMORY, false);
+    if (model.load_stage < 0) model.load_stage = model.execute_stage;
+    model.fetch_ready = 1;
+
+    const MicroOp *op = &cpu->uops[0];
+    while (op) {
+        int index = (int)(op - cpu->uops);
+        if (index >= cpu->instruction_count) { // Halt sentinel
+            op = op->handler(cpu, op);
+            break;
+        }
+        uint16_t instruction = cpu->instruction_memory[index].current_Instruction;
+        bool executes = instruction != 0 && op->handler != uop_invalid;
+        bool redirects = executes && (op->opcode == 0x07 || (op->opcode == 0x04 && cpu->registers[op->rd] == 0));
+        long t[PIPELINE_MAX_STAGES];
+        model_instruction(cpu, &model, index, op, executes, t);
+
+        long done = executes ? t[depth - 1] : t[0];
+        if (cpu->max_cycles > 0 && done > cpu->max_cycles) {
+            LOG(cpu, LOG_SUMMARY, "Cycle budget of %ld cycles exhausted, stopping the run\n", cpu->max_cycles);
+            model.cycles = cpu->max_cycles;
+            break;
+        }
+        if (cpu->log_level >= LOG_DELTA) {
+            printf("Instruction %d 0x%04X:", index + 1, instruction);
+            for (int s = 0; s < (executes ? depth : 1); s++) {
+                printf(" %s %ld", model.pipeline->stages[s].name, t[s]);
+            }
+            printf("\n");
+        }
+        if (done > model.cycles) model.cycles = done;
+        if (redirects) {
+            long resolved = t[model.execute_stage];
+            if (resolved > t[0] + 1) {
+                cpu->counters.fetch_stalls += resolved - t[0] - 1;
+                cpu->counters.pc_stalls[index] += resolved - t[0] - 1;
+            }
+            model.fetch_ready = resolved;
+        }
+        op = op->handler(cpu, op);
+    }
+    cpu->cycle_count = model.cycles;
+    cpu->host_seconds = host_time() - start;
+
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->log_level >= LOG_SUMMARY) {
+        printf("Pipeline: %d-stage (", depth);
+        for (int s = 0; s < depth; s++) {
+            printf("%s%s", s ? " " : "", model.pipeline->stages[s].name);
+        }
+        printf("), %d-wide in-order issue\n", width);
+        printf("Stall cycles: %ld control, %ld data, %ld load-use\n", cpu->counters.fetch_stalls,
+               cpu->counters.data_stalls, cpu->counters.load_use_stalls);
+    }
+    if (cpu->counters_file) {
+        char mode[32];
+        snprintf(mode, sizeof(mode), "pipeline-%dx%d", depth, width);
+        write_perf_counters(cpu, cpu->counters_file, mode);
+    }
+}
+
+// CPI table over every pipeline depth and issue width for one loaded program
+int run_pipeline_sweep(const CPU *program, const RunOptions *options) {
+    CPU *cpu = malloc(sizeof(CPU));
+    if (!cpu) {
+        printf("Error: Out of memory\n");
+        return 1;
+    }
+
+    printf("Pipeline sweep (forwarding %s):\n", options->forwarding == FORWARD_NONE ? "none" : "ex");
+    printf("%-8s %5s %10s %10s %7s %9s %9s %9s\n", "Stages", "Width", "Cycles", "Retired", "CPI", "Control", "Data", "Load-use");
+    memcpy(cpu, program, sizeof(CPU));
+    for (size_t d = 0; d < sizeof(pipeline_descriptions) / sizeof(pipeline_descriptions[0]); d++) {
+        for (size_t w = 0; w < sizeof(issue_widths) / sizeof(issue_widths[0]); w++) {
+            reset_cpu(cpu, program);
+            cpu->log_level = LOG_SILENT;
+            cpu->counters_file = NULL;
+            cpu->trace_file = NULL;
+            run_pipeline_model(cpu, pipeline_descriptions[d].depth, issue_widths[w]);
+            printf("%-8d %5d %10ld %10ld %7.3f %9ld %9ld %9ld\n", pipeline_descriptions[d].depth, issue_widths[w],
+                   cpu->cycle_count, cpu->retired_count,
+                   cpu->retired_count > 0 ? (double)cpu->cycle_count / cpu->retired_count : 0.0,
+                   cpu->counters.fetch_stalls, cpu->counters.data_stalls, cpu->counters.load_use_stalls);
+        }
+    }
+    free(cpu);
+    return 0;
+}
+
+static int ooo_latency(uint8_t opcode) {
+    switch (opcode) {
+        case 0x02: return OOO_MUL_LATENCY;
+        case 0x0A: return OOO_LOAD_LATENCY;
+        default: return OOO_ALU_LATENCY;
+    }
+}
+
+// Fetch queue entry for the instruction at index, with architectural register and memory operands
+static void ooo_decode(const CPU *cpu, int index, long now, OooEntry *entry) {
+    uint16_t instruction = cpu->instruction_memory[index].current_Instruction;
+    int regs[2];
+    memset(entry, 0, sizeof(*entry));
+    entry->index = index;
+    entry->opcode = (instruction >> 12) & 0xF;
+    entry->source_count = instruction_sources(instruction, regs);
+    entry->source_regs[0] = regs[0];
+    entry->source_regs[1] = regs[1];
+    entry->dest = opcode_writes_rd(entry->opcode) ? (instruction >> 8) & 0xF : -1;
+    entry->sets_flags = entry->dest >= 0; // Every instruction that writes RD also updates SREG
+    entry->mem_read = entry->opcode == 0x0A ? instruction & 0x3F : -1;
+    entry->mem_write = entry->opcode == 0x0B ? instruction & 0x3F : -1;
+    entry->fetch_cycle = now;
+}
+
+// Up to `width` instructions a cycle. The correct path comes from the functional micro-ops, run in
+// program order as they are fetched; behind a taken BEQZ fetch carries on sequentially (static
+// not-taken) until the branch executes, and a BR stops fetch until its target is known, as in decode().
+static void ooo_fetch(CPU *cpu, OooCore *core, long now) {
+    for (int slot = 0; slot < core->width; slot++) {
+        if (core->fetch_blocked || core->fetched_count == 2 * core->width) return;
+        OooEntry *entry = &core->fetched[core->fetched_count];
+
+        if (core->wrong_path_pc >= 0) {
+            if (core->wrong_path_pc >= cpu->instruction_count) return;
+            int index = core->wrong_path_pc++;
+            uint16_t instruction = cpu->instruction_memory[index].current_Instruction;
+            uint8_t opcode = (instruction >> 12) & 0xF;
+            if (instruction == 0 || (opcode > 0x0B && opcode != HALT_OPCODE)) continue; // Takes a fetch slot only
+            ooo_decode(cpu, index, now, entry);
+            entry->wrong_path = true;
+            if (opcode == 0x07 || opcode == HALT_OPCODE) {
+                core->wrong_path_pc = cpu->instruction_count;
+            }
+        } else {
+            const MicroOp *op = core->next_op;
+            if (!op) return;
+            int index = (int)(op - cpu->uops);
+            if (index >= cpu->instruction_count) { // Halt sentinel
+                core->next_op = op->handler(cpu, op);
+                return;
+            }
+            uint16_t instruction = cpu->instruction_memory[index].current_Instruction;
+            bool taken = op->opcode == 0x04 && cpu->registers[op->rd] == 0;
+            bool valid = instruction != 0 && op->handler != uop_invalid;
+            core->next_op = op->handler(cpu, op);
+            if (!valid) continue;
+            ooo_decode(cpu, index, now, entry);
+            if (op->opcode == 0x07) {
+                entry->redirect = true;
+                core->fetch_blocked = true;
+            } else if (op->opcode == 0x04 && taken) {
+                entry->redirect = true;
+                core->wrong_path_pc = index + 1;
+            }
+        }
+        core->fetched_count++;
+    }
+}
+
+// Rename and allocate a reorder buffer entry and a reservation station, oldest fetched first
+static void ooo_dispatch(OooCore *core, long now) {
+    for (int n = 0; n < core->width && core->fetched_count > 0 && core->fetched[0].fetch_cycle < now; n++) {
+        OooEntry *entry = &core->fetched[0];
+        bool needs_station = entry->opcode != HALT_OPCODE;
+        if (core->tail_seq - core->head_seq == core->rob_size) {
+            core->rob_full_stalls++;
+            return;
+        }
+        if (needs_station && core->rs_used == core->rs_size) {
+            core->rs_full_stalls++;
+            return;
+        }
+
+        entry->seq = core->tail_seq++;
+        for (int k = 0; k < 3; k++) {
+            entry->sources[k] = -1;
+        }
+        for (int k = 0; k < entry->source_count; k++) {
+            entry->sources[k] = core->rename[entry->source_regs[k]];
+        }
+        if (entry->mem_read >= 0) entry->sources[2] = core->mem_rename[entry->mem_read];
+        if (entry->dest >= 0) core->rename[entry->dest] = entry->seq;
+        if (entry->sets_flags) core->rename[65] = entry->seq;
+        if (entry->mem_write >= 0) core->mem_rename[entry->mem_write] = entry->seq;
+        if (needs_station) {
+            core->rs_used++;
+        } else {
+            entry->issued = true;
+            entry->ready_cycle = now + 1;
+        }
+
+        core->rob[entry->seq % core->rob_size] = *entry;
+        core->fetched_count--;
+        memmove(core->fetched, core->fetched + 1, core->fetched_count * sizeof(OooEntry));
+    }
+}
+
+static bool ooo_operand_ready(const OooCore *core, long producer, long now) {
+    if (producer < core->head_seq) return true; // Committed, or read from the register file at rename
+    const OooEntry *entry = &core->rob[producer % core->rob_size];
+    return entry->issued && entry->ready_cycle <= now;
+}
+
+// Oldest-first select of up to `width` reservation stations whose operands have been broadcast
+static void ooo_issue(OooCore *core, long now) {
+    int issued = 0;
+    for (long seq = core->head_seq; seq < core->tail_seq && issued < core->width; seq++) {
+        OooEntry *entry = &core->rob[seq % core->rob_size];
+        if (entry->issued) continue;
+        bool ready = true;
+        for (int k = 0; k < 3 && ready; k++) {
+            ready = ooo_operand_ready(core, entry->sources[k], now);
+        }
+        if (!ready) continue;
+        entry->issued = true;
+        entry->ready_cycle = now + ooo_latency(entry->opcode);
+        core->rs_used--;
+        issued++;
+    }
+}
+
+// Discard everything younger than the branch, the same squash flush() applies to IFID and IDEX,
+// and rebuild the rename table from the surviving entries
+static void ooo_squash(OooCore *core, long branch_seq) {
+    for (long seq = branch_seq + 1; seq < core->tail_seq; seq++) {
+        if (!core->rob[seq % core->rob_size].issued) core->rs_used--;
+        core->squashed++;
+    }
+    core->squashed += core->fetched_count;
+    core->fetched_count = 0;
+    core->tail_seq = branch_seq + 1;
+
+    for (int r = 0; r < REGISTER_COUNT; r++) {
+        core->rename[r] = -1;
+    }
+    for (int a = 0; a < 64; a++) {
+        core->mem_rename[a] = -1;
+    }
+    for (long seq = core->head_seq; seq < core->tail_seq; seq++) {
+        const OooEntry *entry = &core->rob[seq % core->rob_size];
+        if (entry->dest >= 0) core->rename[entry->dest] = seq;
+        if (entry->sets_flags) core->rename[65] = seq;
+        if (entry->mem_write >= 0) core->mem_rename[entry->mem_write] = seq;
+    }
+}
+
+// Branches that finished executing this cycle send fetch down the real path
+static void ooo_resolve(OooCore *core, long now) {
+    for (long seq = core->head_seq; seq < core->tail_seq; seq++) {
+        OooEntry *entry = &core->rob[seq % core->rob_size];
+        if (!entry->redirect || entry->resolved || !entry->issued || entry->ready_cycle > now) continue;
+        entry->resolved = true;
+        if (entry->opcode == 0x07) {
+            core->fetch_blocked = false;
+        } else {
+            core->mispredicts++;
+            core->wrong_path_pc = -1;
+            ooo_squash(core, seq);
+        }
+    }
+}
+
+static void ooo_commit(OooCore *core, long now) {
+    for (int n = 0; n < core->width && core->head_seq < core->tail_seq; n++) {
+        const OooEntry *entry = &core->rob[core->head_seq % core->rob_size];
+        if (!entry->issued || entry->ready_cycle > now) return;
+        core->head_seq++;
+        core->committed++;
+        if (entry->opcode == HALT_OPCODE) {
+            core->halt_committed = true;
+            return;
+        }
+    }
+}
+
+// Tomasulo-style core: rename over R0-R63 and SREG, a unified pool of reservation stations, results
+// broadcast by tag and in-order commit from the reorder buffer. Architectural results come from the
+// functional micro-ops; the model only decides when each instruction can issue and retire.
+void run_out_of_order(CPU *cpu, int rob_size, int rs_size, int width) {
+    double start = host_time();
+    OooCore *core = calloc(1, sizeof(OooCore));
+    if (!core) {
+        printf("Error: Out of memory\n");
+        return;
+    }
+    core->rob_size = rob_size;
+    core->rs_size = rs_size;
+    core->width = width;
+    core->next_op = &cpu->uops[0];
+    core->wrong_path_pc = -1;
+    for (int r = 0; r < REGISTER_COUNT; r++) {
+        core->rename[r] = -1;
+    }
+    for (int a = 0; a < 64; a++) {
+        core->mem_rename[a] = -1;
+    }
+
+    long now = 0;
+    while (!core->halt_committed &&
+           (core->next_op || core->fetched_count > 0 || core->head_seq < core->tail_seq)) {
+        if (cpu->max_cycles > 0 && now >= cpu->max_cycles) {
+            LOG(cpu, LOG_SUMMARY, "Cycle budget of %ld cycles exhausted, stopping the run\n", cpu->max_cycles);
+            break;
+        }
+        now++;
+        int occupancy = (int)(core->tail_seq - core->head_seq);
+        core->occupancy_sum += occupancy;
+        if (occupancy > core->occupancy_peak) core->occupancy_peak = occupancy;
+
+        // Back to front, so a stage sees what the stage ahead of it freed this cycle
+        ooo_resolve(core, now);
+        ooo_commit(core, now);
+        ooo_issue(core, now);
+        ooo_dispatch(core, now);
+        ooo_fetch(cpu, core, now);
+    }
+
+    cpu->cycle_count = now;
+    cpu->retired_count = core->committed;
+    cpu->counters.beqz_mispredicted = core->mispredicts;
+    cpu->counters.squashed = core->squashed;
+    cpu->host_seconds = host_time() - start;
+
+    End_program(cpu);
+    print_run_statistics(cpu);
+    if (cpu->log_level >= LOG_SUMMARY) {
+        printf("Out-of-order core: ROB %d, %d reservation stations, %d-wide\n", rob_size, rs_size, width);
+        if (now > 0) {
+            printf("IPC: %.3f\n", (double)core->committed / now);
+            printf("ROB occupancy: %.2f average, %d peak\n", (double)core->occupancy_sum / now, core->occupancy_peak);
+        }
+        printf("Rename stalls: %ld ROB full, %ld reservation stations full\n", core->rob_full_stalls, core->rs_full_stalls);
+        printf("Mispredicted BEQZ: %ld, squashed instructions: %ld\n", core->mispredicts, core->squashed);
+    }
+    if (cpu->counters_file) {
+        write_perf_counters(cpu, cpu->counters_file, "ooo");
+    }
+    free(core);
+}
+
+double host_time(void) {
+#ifdef _WIN32
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (double)now.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+void print_run_statistics(CPU *cpu) {
+    if (cpu->log_level < LOG_SUMMARY) return;
+
+    printf("\nRun Statistics:\n");
+    if (cpu->cycle_count > 0) {
+        printf("Simulated cycles: %ld\n", cpu->cycle_count);
+    }
+    printf("Retired instructions: %ld\n", cpu->retired_count);
+    if (cpu->samples > 0) {
+        printf("Fast-forwarded instructions: %ld\n", cpu->fast_forwarded);
+        printf("Measured: %ld instructions in %ld cycles over %d sample%s\n", cpu->measured_instructions,
+               cpu->measured_cycles, cpu->samples, cpu->samples == 1 ? "" : "s");
+        if (cpu->measured_instructions > 0) {
+            printf("Sampled CPI: %.3f\n", (double)cpu->measured_cycles / cpu->measured_instructions);
+        }
+    } else if (cpu->cycle_count > 0 && cpu->retired_count > 0) {
+        printf("CPI: %.3f\n", (double)cpu->cycle_count / cpu->retired_count);
+    }
+    printf("Host time: %.6f s\n", cpu->host_seconds);
+    if (cpu->host_seconds > 0) {
+        printf("Simulated MIPS: %.2f\n", cpu->retired_count / cpu->host_seconds / 1e6);
+    }
+
+    const PerfCounters *counters = &cpu->counters;
+    if (cpu->cycle_count > 0 && cpu->forwarding == FORWARD_NONE) {
+        printf("Forwarding: none, interlock stalls: %ld data, %ld load-use\n", counters->data_stalls, counters->load_use_stalls);
+    }
+    if (cpu->cycle_count > 0 && (cpu->predictor.kind != PREDICT_NOT_TAKEN || cpu->predictor.btb_entries > 0)) {
+        long branches = counters->beqz_taken + counters->beqz_not_taken;
+        printf("Branch predictor: %s, BTB %d entries\n", predictor_names[cpu->predictor.kind], cpu->predictor.btb_entries);
+        if (branches > 0) {
+            printf("BEQZ prediction accuracy: %.2f%% (%ld of %ld)\n", 100.0 * (branches - counters->beqz_mispredicted) / branches,
+                   branches - counters->beqz_mispredicted, branches);
+        }
+        if (cpu->predictor.btb_entries > 0) {
+            printf("BTB hits: %ld, misses: %ld, wrong targets: %ld\n", counters->btb_hits, counters->btb_misses, counters->btb_mispredicted);
+        }
+        printf("Cycles saved by prediction: %ld\n", counters->saved_cycles);
+    }
+    if (cpu->cycle_count > 0 && cpu->dcache.size > 0) {
+        const DataCache *cache = &cpu->dcache;
+        long accesses = counters->dcache_hits + counters->dcache_misses;
+        printf("Data cache: %d bytes, %d-way, %d-byte lines, write-%s, %d/%d cycle hit/miss\n", cache->size, cache->ways,
+               cache->line_size, cache->write_back ? "back" : "through", cache->hit_latency, cache->miss_latency);
+        if (accesses > 0) {
+            printf("Data cache hit rate: %.2f%% (%ld of %ld), %ld writebacks\n", 100.0 * counters->dcache_hits / accesses,
+                   counters->dcache_hits, accesses, counters->dcache_writebacks);
+        }
+        printf("Memory stall cycles: %ld, %ld of them on misses\n", counters->dcache_stalls, counters->dcache_miss_stalls);
+    }
+}
 
-        switch (cpu->IDEX.opcode) {
-            case 0x00: // ADD
-            case 0x01: // SUB
-            case 0x02: // MUL
-            case 0x06: // EOR
-                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
-                cpu->IDEX.rs1 = (instruction >> 4) & 0xF; // Source register 1 (next 4 bits)
-                cpu->IDEX.immediate = 0;                  // No immediate value for R-type instructions
-                break;
+bool profile_open(const char *filename) {
+    host_profile = calloc(1, sizeof(HostProfile));
+    if (!host_profile) {
+        printf("Error: Out of memory for the host profile\n");
+        return false;
+    }
+    host_profile->file = filename;
 
-            case 0x03: // MOVI
-            case 0x04: // BEQZ
-                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
-                cpu->IDEX.rs1 = 0;                        // No source register for I-type instructions
-                cpu->IDEX.immediate = instruction & 0x3F; // Immediate value (last 6 bits)
-                if (cpu->IDEX.immediate & 0x20) { // Handle sign extension for negative IMM
-                    cpu->IDEX.immediate |= 0xC0;
-                }
-                break;
+    HostProfile *profile = host_profile;
+    // The cheapest of many empty scopes, so the correction never takes out more than the timers cost
+    uint64_t timer = UINT64_MAX, scope = UINT64_MAX;
+    for (int i = 0; i < PROFILE_CALIBRATION_ROUNDS; i++) {
+        uint64_t measured = profile->node_count > 0 ? profile->nodes[0].ticks : 0;
+        uint64_t before = profile_ticks();
+        uint64_t start = profile_enter(PROFILE_MAIN, 1);
+        profile_leave(start);
+        uint64_t after = profile_ticks();
+        if (profile->nodes[0].ticks - measured < timer) timer = profile->nodes[0].ticks - measured;
+        if (after - before < scope) scope = after - before;
+    }
+    memset(profile->nodes, 0, sizeof(profile->nodes));
+    memset(profile->children, 0, sizeof(profile->children));
+    profile->node_count = 0;
+    profile->timer_ticks = timer;
+    profile->scope_ticks = scope;
 
-            case 0x05: // ANDI
-            case 0x08: // SAL
-            case 0x09: // SAR
-            case 0x0A: // LDR
-            case 0x0B: // STR
-                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
-                cpu->IDEX.rs1 = 0;                        // No source register for I-type instructions
-                cpu->IDEX.immediate = instruction & 0x3F; // Immediate value (last 6 bits)
-                if (cpu->IDEX.immediate < 0 || cpu->IDEX.immediate > 63) {
-                    printf("Error: Instruction with invalid immediate value %d (valid range is 0-63)\n", cpu->IDEX.immediate);
-                    erase_IDEX(cpu);
-                    return;
+    host_profile->start_seconds = host_time();
+    host_profile->start_ticks = profile_ticks();
+    host_profile->root_start = profile_enter(PROFILE_MAIN, 1);
+    return true;
+}
+
+static uint64_t profile_self_ticks(const HostProfile *profile, int node) {
+    uint64_t children = 0;
+    for (int n = 0; n < profile->node_count; n++) {
+        if (profile->nodes[n].parent == node) children += profile->nodes[n].ticks;
+    }
+    // Sampled children are estimates, so they can add up to a little more than their parent
+    return profile->nodes[node].ticks > children ? profile->nodes[node].ticks - children : 0;
+}
+
+static void print_profile_node(const HostProfile *profile, int node, int depth, double tick_seconds) {
+    const ProfileNode *entry = &profile->nodes[node];
+    uint64_t total = profile->nodes[0].ticks;
+    uint64_t self = profile_self_ticks(profile, node);
+    printf("%*s%-*s %10.6f s %6.2f%% %10.6f s %6.2f%% %12ld\n", 2 * depth, "", 28 - 2 * depth, profile_stage_names[entry->stage],
+           entry->ticks * tick_seconds, total ? 100.0 * entry->ticks / total : 0, self * tick_seconds,
+           total ? 100.0 * self / total : 0, entry->calls);
+    for (int n = 0; n < profile->node_count; n++) {
+        if (profile->nodes[n].parent == node) print_profile_node(profile, n, depth + 1, tick_seconds);
+    }
+}
+
+static void write_profile_stack(FILE *out, const HostProfile *profile, int node) {
+    if (profile->nodes[node].parent >= 0) {
+        write_profile_stack(out, profile, profile->nodes[node].parent);
+        fputc(';', out);
+    }
+    fputs(profile_stage_names[profile->nodes[node].stage], out);
+}
+
+// Close the profile: print the stage breakdown and write the collapsed stacks
+bool profile_close(void) {
+    HostProfile *profile = host_profile;
+    if (!profile) return true;
+    profile_leave(profile->root_start);
+    double seconds = host_time() - profile->start_seconds;
+    uint64_t ticks = profile_ticks() - profile->start_ticks;
+    double tick_seconds = ticks > 0 ? seconds / ticks : 0;
+    host_profile = NULL;
+
+    printf("\nHost profile (stages inside pipeline cycles timed in 1 of %d cycles, %.3f GHz ticks):\n",
+           PROFILE_SAMPLE_PERIOD, seconds > 0 ? ticks / seconds / 1e9 : 0);
+    printf("%-28s %12s %7s %12s %7s %12s\n", "Stage", "Total", "", "Self", "", "Calls");
+    print_profile_node(profile, 0, 0, tick_seconds);
+    fflush(stdout);
+
+    FILE *out = fopen(profile->file, "w");
+    bool ok = out != NULL;
+    for (int n = 0; ok && n < profile->node_count; n++) {
+        uint64_t self = profile_self_ticks(profile, n);
+        if (self == 0) continue;
+        write_profile_stack(out, profile, n);
+        fprintf(out, " %llu\n", (unsigned long long)self);
+    }
+    if (out && fclose(out) != 0) ok = false;
+    if (!ok) {
+        printf("Error: Unable to write file %s\n", profile->file);
+    }
+    free(profile);
+    return ok;
+}
+
+// JSON counterpart of the End_program dump: event counters, per-opcode counts and the per-PC heat map
+bool write_perf_counters(CPU *cpu, const char *filename, const char *mode) {
+    FILE *out = strcmp(filename, "-") == 0 ? stdout : fopen(filename, "w");
+    if (!out) {
+        printf("Error: Unable to open file %s\n", filename);
+        return false;
+    }
+    const PerfCounters *counters = &cpu->counters;
+
+    long opcode_counts[16] = {0};
+    for (int i = 0; i < cpu->instruction_count; i++) {
+        opcode_counts[(cpu->instruction_memory[i].current_Instruction >> 12) & 0xF] += counters->pc_executed[i];
+    }
+
+    fprintf(out, "{\n  \"mode\": \"%s\",\n", mode);
+    fprintf(out, "  \"cycles\": %ld,\n  \"retired\": %ld,\n", cpu->cycle_count, cpu->retired_count);
+    fprintf(out, "  \"cpi\": %.4f,\n", cpu->retired_count > 0 ? (double)cpu->cycle_count / cpu->retired_count : 0.0);
+    fprintf(out, "  \"opcodes\": {");
+    for (size_t i = 0; i < sizeof(opcode_table) / sizeof(opcode_table[0]); i++) {
+        fprintf(out, "%s\"%s\": %ld", i ? ", " : "", opcode_table[i].mnemonic, opcode_counts[opcode_table[i].opcode]);
+    }
+    fprintf(out, "},\n");
+    fprintf(out, "  \"fetch_stalls\": %ld,\n", counters->fetch_stalls);
+    fprintf(out, "  \"stalls\": {\"control\": %ld, \"data\": %ld, \"load_use\": %ld},\n",
+            counters->fetch_stalls, counters->data_stalls, counters->load_use_stalls);
+    fprintf(out, "  \"flushes\": {\"beqz\": %ld, \"br\": %ld, \"squashed\": %ld},\n",
+            counters->flushes, counters->br_flushes, counters->squashed);
+    fprintf(out, "  \"beqz\": {\"taken\": %ld, \"not_taken\": %ld, \"mispredicted\": %ld},\n",
+            counters->beqz_taken, counters->beqz_not_taken, counters->beqz_mispredicted);
+    fprintf(out, "  \"predictor\": {\"kind\": \"%s\", \"btb_entries\": %d, \"btb_hits\": %ld, \"btb_misses\": %ld, "
+            "\"btb_mispredicted\": %ld, \"saved_cycles\": %ld},\n", predictor_names[cpu->predictor.kind],
+            cpu->predictor.btb_entries, counters->btb_hits, counters->btb_misses, counters->btb_mispredicted, counters->saved_cycles);
+    fprintf(out, "  \"dcache\": {\"size\": %d, \"ways\": %d, \"line_size\": %d, \"write_back\": %s, \"hits\": %ld, "
+            "\"misses\": %ld, \"writebacks\": %ld, \"stall_cycles\": %ld, \"miss_stall_cycles\": %ld},\n",
+            cpu->dcache.size, cpu->dcache.ways, cpu->dcache.line_size, cpu->dcache.write_back ? "true" : "false",
+            counters->dcache_hits, counters->dcache_misses, counters->dcache_writebacks, counters->dcache_stalls,
+            counters->dcache_miss_stalls);
+    fprintf(out, "  \"pc_heat\": [");
+    bool first = true;
+    for (int i = 0; i < INSTRUCTION_MEMORY_SIZE; i++) {
+        if (counters->pc_executed[i] == 0 && counters->pc_stalls[i] == 0) continue;
+        fprintf(out, "%s\n    {\"pc\": %d, \"executed\": %ld, \"stalls\": %ld}", first ? "" : ",", i,
+                counters->pc_executed[i], counters->pc_stalls[i]);
+        first = false;
+    }
+    fprintf(out, "%s]\n}\n", first ? "" : "\n  ");
+
+    bool ok = !ferror(out);
+    if (out != stdout && fclose(out) != 0) ok = false;
+    if (!ok) {
+        printf("Error: Unable to write file %s\n", filename);
+    }
+    return ok;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t value) {
+    for (; value >= 0x80; value >>= 7) {
+        *p++ = (uint8_t)(value | 0x80);
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = *p++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return p;
+    }
+    return NULL;
+}
+
+// Lengths of 15 and more continue in bytes of 255 and a final byte below it
+static uint8_t *put_lz_length(uint8_t *p, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        *p++ = 255;
+    }
+    *p++ = (uint8_t)length;
+    return p;
+}
+
+static const uint8_t *get_lz_length(const uint8_t *p, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (p == end) return NULL;
+        byte = *p++;
+        *length += byte;
+    } while (byte == 255);
+    return p;
+}
+
+// LZ77 over one block in the LZ4 sequence layout: a token (literal count << 4 | match length - 4),
+// the literals, a u16 match offset and any length continuation bytes. The last sequence has no match.
+// out needs room for size + size / 255 + 16 bytes.
+static size_t trace_compress(const uint8_t *in, size_t size, uint8_t *out) {
+    uint32_t table[1 << TRACE_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+    uint8_t *p = out;
+    size_t anchor = 0, i = 0;
+    while (i + 4 <= size) {
+        uint32_t word;
+        memcpy(&word, in + i, 4);
+        uint32_t slot = (word * 2654435761u) >> (32 - TRACE_HASH_BITS);
+        uint32_t candidate = table[slot];
+        table[slot] = (uint32_t)i;
+        if (candidate == UINT32_MAX || i - candidate > 0xFFFF || memcmp(in + candidate, in + i, 4) != 0) {
+            i++;
+            continue;
+        }
+
+        size_t length = 4;
+        while (i + length < size && in[candidate + length] == in[i + length]) {
+            length++;
+        }
+        size_t literals = i - anchor;
+        uint8_t *token = p++;
+        *token = (uint8_t)((literals < 15 ? literals : 15) << 4 | (length - 4 < 15 ? length - 4 : 15));
+        if (literals >= 15) p = put_lz_length(p, literals);
+        memcpy(p, in + anchor, literals);
+        p += literals;
+        put_u16(p, (uint16_t)(i - candidate));
+        p += 2;
+        if (length - 4 >= 15) p = put_lz_length(p, length - 4);
+        i += length;
+        anchor = i;
+    }
+
+    size_t literals = size - anchor;
+    *p++ = (uint8_t)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) p = put_lz_length(p, literals);
+    memcpy(p, in + anchor, literals);
+    return p + literals - out;
+}
+
+static bool trace_decompress(const uint8_t *in, size_t size, uint8_t *out, size_t raw_size) {
+    const uint8_t *end = in + size;
+    size_t done = 0;
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !(in = get_lz_length(in, end, &literals))) return false;
+        if (literals > (size_t)(end - in) || literals > raw_size - done) return false;
+        memcpy(out + done, in, literals);
+        in += literals;
+        done += literals;
+        if (in == end) break;
+
+        if (end - in < 2) return false;
+        size_t offset = get_u16(in);
+        size_t length = token & 15;
+        in += 2;
+        if (length == 15 && !(in = get_lz_length(in, end, &length))) return false;
+        length += 4;
+        if (offset == 0 || offset > done || length > raw_size - done) return false;
+        for (; length > 0; length--, done++) {
+            out[done] = out[done - offset]; // Byte by byte: a match may overlap its own output
+        }
+    }
+    return done == raw_size;
+}
+
+static void *trace_writer_thread(void *arg) {
+    TraceWriter *trace = arg;
+    uint8_t *compressed = malloc(TRACE_BLOCK_HEADER_SIZE + TRACE_BLOCK_SIZE + TRACE_BLOCK_SIZE / 255 + 16);
+
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        while (trace->pending_size == 0 && !trace->closing) {
+            pthread_cond_wait(&trace->changed, &trace->lock);
+        }
+        if (trace->pending_size == 0) break;
+        const uint8_t *block = trace->buffers[trace->pending];
+        size_t raw_size = trace->pending_size;
+        uint32_t records = trace->pending_records;
+        pthread_mutex_unlock(&trace->lock);
+
+        bool ok = compressed != NULL;
+        if (ok) {
+            size_t size = trace_compress(block, raw_size, compressed + TRACE_BLOCK_HEADER_SIZE);
+            put_u32(compressed, (uint32_t)size);
+            put_u32(compressed + 4, (uint32_t)raw_size);
+            put_u32(compressed + 8, records);
+            size += TRACE_BLOCK_HEADER_SIZE;
+            ok = fwrite(compressed, 1, size, trace->file) == size;
+            trace->file_bytes += size;
+        }
+
+        pthread_mutex_lock(&trace->lock);
+        trace->failed |= !ok;
+        trace->pending_size = 0;
+        pthread_cond_broadcast(&trace->changed);
+    }
+    pthread_mutex_unlock(&trace->lock);
+    free(compressed);
+    return NULL;
+}
+
+// Hand the filled buffer to the writer thread and carry on in the other one
+static void trace_submit(TraceWriter *trace) {
+    pthread_mutex_lock(&trace->lock);
+    while (trace->pending_size != 0) {
+        pthread_cond_wait(&trace->changed, &trace->lock);
+    }
+    trace->pending = trace->active;
+    trace->pending_size = trace->used;
+    trace->pending_records = trace->records;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+
+    trace->active ^= 1;
+    trace->used = 0;
+    trace->records = 0;
+}
+
+TraceWriter *trace_open(const CPU *cpu, const char *filename) {
+    TraceWriter *trace = calloc(1, sizeof(TraceWriter));
+    uint8_t *header = malloc(TRACE_HEADER_SIZE + 2 * cpu->instruction_count);
+    if (!trace || !header || !(trace->buffers[0] = malloc(2 * TRACE_BLOCK_SIZE))) {
+        printf("Error: Out of memory opening trace %s\n", filename);
+        free(header);
+        free(trace);
+        return NULL;
+    }
+    trace->buffers[1] = trace->buffers[0] + TRACE_BLOCK_SIZE;
+    trace->filename = filename;
+    trace->last = (TraceRecord){ .cycle = cpu->cycle_count, .pc = -1 };
+    trace->flushes = cpu->counters.flushes;
+    trace->br_flushes = cpu->counters.br_flushes;
+    trace->fetch_stalls = cpu->counters.fetch_stalls;
+    trace->data_stalls = cpu->counters.data_stalls + cpu->counters.load_use_stalls;
+    trace->memory_stalls = cpu->counters.dcache_stalls;
+
+    memcpy(header, TRACE_MAGIC, 4);
+    put_u16(header + 4, TRACE_VERSION);
+    put_u16(header + 6, cpu->instruction_count);
+    put_u64(header + 8, cpu->cycle_count);
+    for (int i = 0; i < cpu->instruction_count; i++) {
+        put_u16(header + TRACE_HEADER_SIZE + 2 * i, cpu->instruction_memory[i].current_Instruction);
+    }
+    size_t size = TRACE_HEADER_SIZE + 2 * cpu->instruction_count;
+    trace->file = fopen(filename, "wb");
+    bool ok = trace->file && fwrite(header, 1, size, trace->file) == size;
+    free(header);
+    if (!ok) {
+        printf("Error: Unable to write file %s\n", filename);
+        if (trace->file) fclose(trace->file);
+        free(trace->buffers[0]);
+        free(trace);
+        return NULL;
+    }
+    trace->file_bytes = size;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->changed, NULL);
+    if (pthread_create(&trace->thread, NULL, trace_writer_thread, trace) != 0) {
+        printf("Error: Unable to start the writer thread for trace %s\n", filename);
+        pthread_cond_destroy(&trace->changed);
+        pthread_mutex_destroy(&trace->lock);
+        fclose(trace->file);
+        free(trace->buffers[0]);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+// Flushes the last partial block, waits for the writer thread and frees cpu->trace
+bool trace_close(CPU *cpu) {
+    TraceWriter *trace = cpu->trace;
+    cpu->trace = NULL;
+    if (trace->used > 0) {
+        trace_submit(trace);
+    }
+    pthread_mutex_lock(&trace->lock);
+    trace->closing = true;
+    pthread_cond_broadcast(&trace->changed);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->thread, NULL);
+
+    bool ok = !trace->failed;
+    if (fclose(trace->file) != 0) ok = false;
+    if (ok) {
+        LOG(cpu, LOG_SUMMARY, "Traced %ld instructions into %llu bytes of %s\n", trace->total_records,
+            (unsigned long long)trace->file_bytes, trace->filename);
+    } else {
+        printf("Error: Unable to write file %s\n", trace->filename);
+    }
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->changed);
+    free(trace->buffers[0]);
+    free(trace);
+    return ok;
+}
+
+static void trace_encode(TraceWriter *trace, const TraceRecord *record) {
+    if (trace->used > TRACE_BLOCK_SIZE - TRACE_RECORD_MAX) {
+        trace_submit(trace);
+    }
+    uint8_t *start = trace->buffers[trace->active] + trace->used;
+    uint8_t *p = start + 1;
+    uint8_t tag = 0;
+    if (record->cycle == trace->last.cycle + 1) {
+        tag |= TRACE_CYCLE_NEXT;
+    } else {
+        p = put_varint(p, record->cycle - trace->last.cycle);
+    }
+    if (record->pc == trace->last.pc + 1) {
+        tag |= TRACE_PC_NEXT;
+    } else {
+        p = put_varint(p, record->pc);
+    }
+    if (record->reg >= 0) {
+        tag |= TRACE_REG_WRITE;
+        *p++ = record->reg;
+        *p++ = record->reg_value;
+    }
+    if (record->address >= 0) {
+        tag |= TRACE_MEM_WRITE;
+        p = put_varint(p, record->address);
+        *p++ = record->value;
+    }
+    if (record->sreg != trace->last.sreg) {
+        tag |= TRACE_SREG;
+        *p++ = record->sreg;
+    }
+    if (record->events != 0) {
+        tag |= TRACE_EVENTS;
+        *p++ = record->events;
+    }
+    *start = tag;
+    trace->used += p - start;
+    trace->records++;
+    trace->total_records++;
+    trace->last = *record;
+}
+
+// Called by execute() after the instruction at pc has retired
+void trace_retire(CPU *cpu, int pc, uint8_t opcode, int8_t imm) {
+    TraceWriter *trace = cpu->trace;
+    const PerfCounters *counters = &cpu->counters;
+    TraceRecord record = { .cycle = cpu->cycle_count, .pc = pc, .reg = cpu->written_reg, .address = -1 };
+    record.instruction = cpu->instruction_memory[pc].current_Instruction;
+    if (record.reg >= 0) {
+        record.reg_value = cpu->registers[record.reg];
+    }
+    if (opcode == 0x0B && imm >= 0) {
+        record.address = imm;
+        record.value = cpu->data_memory[imm];
+    }
+    record.sreg = read_status_register(cpu);
+
+    long data_stalls = counters->data_stalls + counters->load_use_stalls;
+    if (counters->flushes != trace->flushes) record.events |= TRACE_EVENT_FLUSH;
+    if (counters->br_flushes != trace->br_flushes) record.events |= TRACE_EVENT_BR_FLUSH;
+    if (counters->fetch_stalls != trace->fetch_stalls) record.events |= TRACE_EVENT_CONTROL_STALL;
+    if (data_stalls != trace->data_stalls) record.events |= TRACE_EVENT_DATA_STALL;
+    if (counters->dcache_stalls != trace->memory_stalls) record.events |= TRACE_EVENT_MEMORY_STALL;
+    trace->flushes = counters->flushes;
+    trace->br_flushes = counters->br_flushes;
+    trace->fetch_stalls = counters->fetch_stalls;
+    trace->data_stalls = data_stalls;
+    trace->memory_stalls = counters->dcache_stalls;
+
+    trace_encode(trace, &record);
+}
+
+static void print_trace_record(const TraceRecord *record) {
+    static const char *const event_names[] = { "flush", "br-flush", "control-stall", "data-stall", "memory-stall" };
+    const OpcodeInfo *info = find_opcode(record->instruction >> 12);
+
+    printf("Cycle %llu: PC %d 0x%04X %-4s", (unsigned long long)record->cycle, record->pc, record->instruction,
+           record->instruction == 0 ? "NOP" : info ? info->mnemonic : "?");
+    if (record->reg >= 0) printf(" R%d = %d", record->reg, record->reg_value);
+    if (record->address >= 0) printf(" [%d] = %d", record->address, record->value);
+    printf(" SREG 0x%02X", record->sreg);
+    for (int i = 0; i < (int)(sizeof(event_names) / sizeof(event_names[0])); i++) {
+        if (record->events & (1 << i)) printf(" %s", event_names[i]);
+    }
+    printf("\n");
+}
+
+// Replays a trace: every record, or with a query only the history of one register (R<n>), the writes
+// to one data memory byte (M<address>) or the executions of one instruction (PC<n>)
+int run_trace_reader(const char *filename, const char *query) {
+    int query_reg = -1, query_address = -1, query_pc = -1;
+    if (query) {
+        int *target = NULL, limit = 0;
+        const char *digits = query + 1;
+        if (toupper((unsigned char)query[0]) == 'R') {
+            target = &query_reg;
+            limit = REGISTER_COUNT;
+        } else if (toupper((unsigned char)query[0]) == 'M') {
+            target = &query_address;
+            limit = DATA_MEMORY_SIZE;
+        } else if (strncasecmp(query, "PC", 2) == 0) {
+            target = &query_pc;
+            limit = INSTRUCTION_MEMORY_SIZE;
+            digits = query + 2;
+        }
+        char *end = NULL;
+        long value = target ? strtol(digits, &end, 10) : -1;
+        if (!target || end == digits || *end != '\0' || value < 0 || value >= limit) {
+            printf("Error: Unknown trace query \"%s\" (use R<register>, M<address> or PC<index>)\n", query);
+            return 1;
+        }
+        *target = (int)value;
+    }
+
+    size_t size;
+    const uint8_t *trace = map_file(filename, &size);
+    if (!trace) {
+        printf("Error: Unable to open file %s\n", filename);
+        return 1;
+    }
+    int instruction_count = size >= TRACE_HEADER_SIZE ? get_u16(trace + 6) : 0;
+    if (size < TRACE_HEADER_SIZE || memcmp(trace, TRACE_MAGIC, 4) != 0 || get_u16(trace + 4) != TRACE_VERSION ||
+        instruction_count > INSTRUCTION_MEMORY_SIZE || size < TRACE_HEADER_SIZE + 2 * (size_t)instruction_count) {
+        printf("Error: %s is not a valid version %d trace\n", filename, TRACE_VERSION);
+        unmap_file(trace, size);
+        return 1;
+    }
+    uint8_t *block = malloc(TRACE_BLOCK_SIZE);
+    if (!block) {
+        printf("Error: Out of memory reading %s\n", filename);
+        unmap_file(trace, size);
+        return 1;
+    }
+
+    const uint8_t *words = trace + TRACE_HEADER_SIZE;
+    const uint8_t *p = words + 2 * instruction_count, *end = trace + size;
+    TraceRecord last = { .cycle = get_u64(trace + 8), .pc = -1 };
+    long records = 0, matches = 0, blocks = 0;
+    uint64_t raw_bytes = 0;
+    bool ok = true;
+    while (ok && p < end) {
+        uint32_t compressed_size = end - p >= TRACE_BLOCK_HEADER_SIZE ? get_u32(p) : 0;
+        uint32_t raw_size = compressed_size ? get_u32(p + 4) : 0;
+        uint32_t count = compressed_size ? get_u32(p + 8) : 0;
+        p += TRACE_BLOCK_HEADER_SIZE;
+        ok = compressed_size > 0 && compressed_size <= (size_t)(end - p) && raw_size <= TRACE_BLOCK_SIZE &&
+             trace_decompress(p, compressed_size, block, raw_size);
+        p += compressed_size;
+        blocks++;
+        raw_bytes += raw_size;
+
+        const uint8_t *r = block, *block_end = block + raw_size;
+        for (uint32_t n = 0; ok && n < count; n++) {
+            uint64_t value = 0;
+            uint8_t tag = r < block_end ? *r++ : 0xFF;
+            TraceRecord record = { .cycle = last.cycle + 1, .pc = last.pc + 1, .reg = -1, .address = -1, .sreg = last.sreg };
+            if (!(tag & TRACE_CYCLE_NEXT)) {
+                ok = (r = get_varint(r, block_end, &value)) != NULL;
+                record.cycle = last.cycle + value;
+            }
+            if (ok && !(tag & TRACE_PC_NEXT)) {
+                ok = (r = get_varint(r, block_end, &value)) != NULL;
+                record.pc = (int)value;
+            }
+            if (ok && (tag & TRACE_REG_WRITE)) {
+                ok = block_end - r >= 2 && r[0] < REGISTER_COUNT;
+                if (ok) {
+                    record.reg = r[0];
+                    record.reg_value = (int8_t)r[1];
+                    r += 2;
                 }
-                break;
+            }
+            if (ok && (tag & TRACE_MEM_WRITE)) {
+                ok = (r = get_varint(r, block_end, &value)) != NULL && value < DATA_MEMORY_SIZE && r < block_end;
+                if (ok) {
+                    record.address = (int)value;
+                    record.value = *r++;
+                }
+            }
+            if (ok && (tag & TRACE_SREG)) {
+                ok = r < block_end;
+                if (ok) record.sreg = *r++;
+            }
+            if (ok && (tag & TRACE_EVENTS)) {
+                ok = r < block_end;
+                if (ok) record.events = *r++;
+            }
+            ok = ok && tag < 0x40 && record.pc >= 0 && record.pc < instruction_count;
+            if (!ok) break;
 
-            case 0x07: // BR
-                cpu->IDEX.rd = (instruction >> 8) & 0xF;  // Destination register (next 4 bits)
-                cpu->IDEX.rs1 = (instruction >> 4) & 0xF; // Source register 1 (next 4 bits)
-                cpu->IDEX.immediate = 0;                  // No immediate value for BR instruction
-                cpu->stall_flag = 1;                      // Stall the pipeline for control hazard
+            record.instruction = get_u16(words + 2 * record.pc);
+            records++;
+            last = record;
+            if ((query_reg >= 0 && record.reg != query_reg) || (query_address >= 0 && record.address != query_address) ||
+                (query_pc >= 0 && record.pc != query_pc)) {
+                continue;
+            }
+            matches++;
+            print_trace_record(&record);
+        }
+        ok = ok && r == block_end;
+    }
+    if (!ok) {
+        printf("Error: %s is truncated or corrupt after %ld records\n", filename, records);
+    }
+
+    printf("%ld of %ld records through cycle %llu; %ld blocks, %llu record bytes in a %zu-byte file\n",
+           matches, records, (unsigned long long)last.cycle, blocks, (unsigned long long)raw_bytes, size);
+    free(block);
+    unmap_file(trace, size);
+    return ok ? 0 : 1;
+}
+
+int host_core_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Claim the next job, from this worker's own range first and then from the other workers in turn
+static int take_batch_job(BatchRun *batch, int worker) {
+    for (int k = 0; k < batch->worker_count; k++) {
+        WorkRange *range = &batch->ranges[(worker + k) % batch->worker_count];
+        if (atomic_load_explicit(&range->next, memory_order_relaxed) >= range->end) continue;
+        int job = atomic_fetch_add_explicit(&range->next, 1, memory_order_relaxed);
+        if (job < range->end) return job;
+    }
+    return -1;
+}
+
+static void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    BatchRun *batch = worker->batch;
+    CPU *cpu = malloc(sizeof(CPU));
+    CPU *template = malloc(sizeof(CPU)); // Freshly loaded copy of the last program this worker ran
+    if (!cpu || !template) {
+        printf("Error: Out of memory in batch worker %d\n", worker->id);
+        free(cpu);
+        free(template);
+        return NULL;
+    }
+
+    const char *template_file = NULL;
+    int index;
+    while ((index = take_batch_job(batch, worker->id)) >= 0) {
+        BatchJob *job = &batch->jobs[index];
+
+        // Jobs over the same program (manifests usually group them) only undo the previous run
+        if (template_file && strcmp(template_file, job->program_file) == 0) {
+            reset_cpu(cpu, template);
+            job->ok = true;
+        } else {
+            initialize_cpu(cpu);
+            apply_run_options(cpu, batch->options);
+            job->ok = load_program(cpu, job->program_file);
+            template_file = NULL;
+            if (job->ok) {
+                memcpy(template, cpu, sizeof(CPU));
+                template_file = job->program_file;
+            }
+        }
+        if (job->ok && job->data_file[0] != 0) {
+            job->ok = load_data_image(cpu, job->data_file);
+        }
+        if (!job->ok) continue;
+
+        run_cpu(cpu, batch->options);
+        read_status_register(cpu);
+        job->cycles = cpu->cycle_count;
+        job->retired = cpu->retired_count;
+        job->host_seconds = cpu->host_seconds;
+        memcpy(job->registers, cpu->registers, sizeof(job->registers));
+        memcpy(job->data_memory, cpu->data_memory, sizeof(job->data_memory));
+    }
+
+    free(cpu);
+    free(template);
+    return NULL;
+}
+
+static void print_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') fputc('\\', out);
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+static void write_batch_report(FILE *out, const BatchJob *jobs, int job_count, int worker_count, double host_seconds) {
+    fprintf(out, "{\n  \"threads\": %d,\n  \"host_seconds\": %.6f,\n  \"jobs\": [\n", worker_count, host_seconds);
+    for (int j = 0; j < job_count; j++) {
+        const BatchJob *job = &jobs[j];
+        fprintf(out, "    {\"program\": ");
+        print_json_string(out, job->program_file);
+        fprintf(out, ", \"data\": ");
+        print_json_string(out, job->data_file);
+        if (!job->ok) {
+            fprintf(out, ", \"status\": \"error\"}%s\n", j + 1 < job_count ? "," : "");
+            continue;
+        }
+
+        fprintf(out, ", \"status\": \"ok\", \"cycles\": %ld, \"retired\": %ld, \"host_seconds\": %.6f, \"pc\": %d, \"sreg\": %d",
+                job->cycles, job->retired, job->host_seconds, job->registers[64], (uint8_t)job->registers[65]);
+
+        // Only non-zero registers and memory bytes, as in End_program
+        const char *separator = "";
+        fprintf(out, ", \"registers\": {");
+        for (int i = 0; i < 64; i++) {
+            if (job->registers[i] != 0) {
+                fprintf(out, "%s\"R%d\": %d", separator, i, job->registers[i]);
+                separator = ", ";
+            }
+        }
+        separator = "";
+        fprintf(out, "}, \"memory\": {");
+        for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+            if (job->data_memory[i] != 0) {
+                fprintf(out, "%s\"%d\": %d", separator, i, job->data_memory[i]);
+                separator = ", ";
+            }
+        }
+        fprintf(out, "}}%s\n", j + 1 < job_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Manifest format: one "program_file [data_image]" per line, blank lines and # comments ignored
+int run_batch(const char *manifest_file, const RunOptions *options, int thread_count, const char *report_file) {
+    FILE *manifest = fopen(manifest_file, "r");
+    if (!manifest) {
+        printf("Error: Unable to open file %s\n", manifest_file);
+        return 1;
+    }
+
+    BatchJob *jobs = NULL;
+    int job_count = 0, job_capacity = 0;
+    char line[2 * MAX_PATH_LENGTH + 16];
+    while (fgets(line, sizeof(line), manifest)) {
+        char program[MAX_PATH_LENGTH], data[MAX_PATH_LENGTH];
+        line[strcspn(line, "#\r\n")] = 0;
+        int fields = sscanf(line, "%255s %255s", program, data);
+        if (fields < 1) continue;
+
+        if (job_count == job_capacity) {
+            job_capacity = job_capacity ? 2 * job_capacity : 64;
+            BatchJob *grown = realloc(jobs, job_capacity * sizeof(BatchJob));
+            if (!grown) {
+                printf("Error: Out of memory reading %s\n", manifest_file);
+                free(jobs);
+                fclose(manifest);
+                return 1;
+            }
+            jobs = grown;
+        }
+        BatchJob *job = &jobs[job_count++];
+        memset(job, 0, sizeof(*job));
+        strcpy(job->program_file, program);
+        if (fields == 2) {
+            strcpy(job->data_file, data);
+        }
+    }
+    fclose(manifest);
+
+    // Batch runs never print per-run output or write per-run files; the report is the only result
+    RunOptions batch_options = *options;
+    batch_options.log_level = LOG_SILENT;
+    batch_options.checkpoint_every = 0;
+    batch_options.counters_file = NULL;
+    batch_options.trace_file = NULL;
+
+    int worker_count = thread_count > 0 ? thread_count : host_core_count();
+    if (worker_count > job_count) worker_count = job_count > 0 ? job_count : 1;
+
+    // Each worker starts with an equal contiguous share of the manifest
+    WorkRange *ranges = malloc(worker_count * sizeof(WorkRange));
+    BatchWorker *workers = malloc(worker_count * sizeof(BatchWorker));
+    pthread_t *threads = malloc(worker_count * sizeof(pthread_t));
+    if (!ranges || !workers || !threads) {
+        printf("Error: Out of memory starting %d batch workers\n", worker_count);
+        free(threads);
+        free(workers);
+        free(ranges);
+        free(jobs);
+        return 1;
+    }
+    BatchRun batch = { jobs, ranges, worker_count, &batch_options };
+    for (int w = 0; w < worker_count; w++) {
+        atomic_init(&ranges[w].next, (int)((long)job_count * w / worker_count));
+        ranges[w].end = (int)((long)job_count * (w + 1) / worker_count);
+        workers[w].batch = &batch;
+        workers[w].id = w;
+    }
+
+    // Worker 0 runs on this thread; it steals the ranges of any worker whose thread failed to start
+    double start = host_time();
+    int started = 1;
+    while (started < worker_count && pthread_create(&threads[started], NULL, batch_worker, &workers[started]) == 0) {
+        started++;
+    }
+    batch_worker(&workers[0]);
+    for (int w = 1; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+    double elapsed = host_time() - start;
+
+    FILE *out = report_file ? fopen(report_file, "w") : stdout;
+    if (!out) {
+        printf("Error: Unable to open file %s\n", report_file);
+        out = stdout;
+    }
+    write_batch_report(out, jobs, job_count, started, elapsed);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    int failures = 0;
+    for (int j = 0; j < job_count; j++) {
+        if (!jobs[j].ok) failures++;
+    }
+    free(threads);
+    free(workers);
+    free(ranges);
+    free(jobs);
+    return failures ? 1 : 0;
+}
+
+// Wait until every core has finished the window; returns how many of them are still running
+static int cycle_barrier_wait(CycleBarrier *barrier, bool running) {
+    int generation = atomic_load_explicit(&barrier->generation, memory_order_acquire);
+    if (running) {
+        atomic_fetch_add_explicit(&barrier->running, 1, memory_order_relaxed);
+    }
+    if (atomic_fetch_add_explicit(&barrier->arrived, 1, memory_order_acq_rel) == barrier->count - 1) {
+        barrier->result = atomic_exchange_explicit(&barrier->running, 0, memory_order_relaxed);
+        atomic_store_explicit(&barrier->arrived, 0, memory_order_relaxed);
+        atomic_store_explicit(&barrier->generation, generation + 1, memory_order_release);
+        return barrier->result;
+    }
+    for (int spins = 0; atomic_load_explicit(&barrier->generation, memory_order_acquire) == generation; spins++) {
+        if (spins >= barrier->spins) sched_yield();
+    }
+    return barrier->result;
+}
+
+// One core: run the window, then take every core's stores of that window in core order, so a
+// byte several cores stored ends up with the value of the highest-numbered one on every core.
+// Loads see other cores' stores from the next window on, whatever order the threads ran in.
+static void *multicore_worker(void *arg) {
+    MulticoreCore *core = arg;
+    MulticoreRun *run = core->run;
+    CPU *cpu = core->cpu;
+    // The barrier counts on every core arriving, so nobody starts until all the threads exist
+    int go;
+    while ((go = atomic_load_explicit(&run->go, memory_order_acquire)) == 0) {
+        sched_yield();
+    }
+    if (go < 0) return NULL;
+
+    for (long window = 0;; window++) {
+        SharedStores *stores = &core->stores[window & 1];
+        stores->written = 0;
+        cpu->shared_stores = stores;
+        long end = (window + 1) * run->window;
+        while (!cpu->halted && !pipeline_drained(cpu) && cpu->cycle_count < end) {
+            if (cpu->max_cycles > 0 && cpu->cycle_count >= cpu->max_cycles) {
+                core->budget_exhausted = true;
                 break;
+            }
+            pipeline_cycle(cpu);
+        }
+        bool running = !cpu->halted && !pipeline_drained(cpu) && !core->budget_exhausted;
+        int still_running = cycle_barrier_wait(&run->barrier, running);
 
-            default:
-                printf("Error: Unknown opcode 0x%X\n", cpu->IDEX.opcode);
-                cpu->IDEX.isempty = 1;
-                return;
+        uint64_t seen = 0;
+        for (int c = 0; c < run->core_count; c++) {
+            const SharedStores *other = &run->cores[c].stores[window & 1];
+            for (uint64_t bits = other->written; bits; bits &= bits - 1) {
+                int address = __builtin_ctzll(bits);
+                cpu->data_memory[address] = other->values[address];
+            }
+            if (core->id == 0) {
+                run->shared_stores += __builtin_popcountll(other->written);
+                run->conflicts += __builtin_popcountll(other->written & seen);
+            }
+            seen |= other->written;
+        }
+        if (seen) {
+            mark_data_dirty(cpu, 0);
+        }
+        if (core->id == 0) {
+            run->windows++;
+        }
+        if (still_running == 0) break;
+    }
+    cpu->shared_stores = NULL;
+    return NULL;
+}
+
+// Several detailed pipelines, one per manifest line ("program [data image]"), sharing the data
+// memory LDR and STR reach. Each core runs on its own host thread and the cores synchronise every
+// `window` cycles; stores become visible to the other cores at the end of their window, so results
+// depend on the window but never on host scheduling. The shared bytes start from core 0's data,
+// overwritten by the non-zero bytes of each later core's.
+int run_multicore(const char *manifest_file, const RunOptions *options, long window) {
+    FILE *manifest = fopen(manifest_file, "r");
+    if (!manifest) {
+        printf("Error: Unable to open file %s\n", manifest_file);
+        return 1;
+    }
+
+    MulticoreRun run = { .window = window };
+    run.cores = calloc(MULTICORE_MAX_CORES, sizeof(MulticoreCore));
+    if (!run.cores) {
+        printf("Error: Out of memory reading %s\n", manifest_file);
+        fclose(manifest);
+        return 1;
+    }
+    bool ok = true;
+    char line[2 * MAX_PATH_LENGTH + 16];
+    while (ok && fgets(line, sizeof(line), manifest)) {
+        char program[MAX_PATH_LENGTH], data[MAX_PATH_LENGTH];
+        line[strcspn(line, "#\r\n")] = 0;
+        int fields = sscanf(line, "%255s %255s", program, data);
+        if (fields < 1) continue;
+        if (run.core_count == MULTICORE_MAX_CORES) {
+            printf("Error: %s lists more than %d cores\n", manifest_file, MULTICORE_MAX_CORES);
+            ok = false;
+            break;
+        }
+
+        MulticoreCore *core = &run.cores[run.core_count++];
+        core->run = &run;
+        core->id = run.core_count - 1;
+        strcpy(core->program_file, program);
+        core->cpu = malloc(sizeof(CPU));
+        if (!core->cpu) {
+            printf("Error: Out of memory reading %s\n", manifest_file);
+            ok = false;
+            break;
+        }
+        initialize_cpu(core->cpu);
+        apply_run_options(core->cpu, options);
+        ok = load_program(core->cpu, program) && (fields < 2 || load_data_image(core->cpu, data));
+    }
+    fclose(manifest);
+    if (ok && run.core_count == 0) {
+        printf("Error: %s lists no programs\n", manifest_file);
+        ok = false;
+    }
+
+    if (ok) {
+        CPU *first = run.cores[0].cpu;
+        for (int c = 1; c < run.core_count; c++) {
+            for (int i = 0; i < MULTICORE_SHARED_BYTES; i++) {
+                if (run.cores[c].cpu->data_memory[i] != 0) first->data_memory[i] = run.cores[c].cpu->data_memory[i];
+            }
+        }
+        for (int c = 0; c < run.core_count; c++) {
+            CPU *cpu = run.cores[c].cpu;
+            memcpy(cpu->data_memory, first->data_memory, MULTICORE_SHARED_BYTES);
+            mark_data_dirty(cpu, 0);
+            read_status_register(cpu);
+            cpu->log_level = LOG_SILENT; // Per-cycle output of several threads would interleave
         }
 
-        // Mark registers as used
-        if (cpu->IDEX.rd != 0) {
-            reg_used[cpu->IDEX.rd] = 1;
+        run.barrier.count = run.core_count;
+        run.barrier.spins = run.core_count <= host_core_count() ? MULTICORE_SPINS : 0;
+        pthread_t *threads = malloc(run.core_count * sizeof(pthread_t));
+        double start = host_time();
+        int started = 1; // Core 0 runs on this thread
+        while (threads && started < run.core_count &&
+               pthread_create(&threads[started], NULL, multicore_worker, &run.cores[started]) == 0) {
+            started++;
         }
-
-        if (cpu->IDEX.rs1 != 0) {
-            reg_used[cpu->IDEX.rs1] = 1;
+        ok = started == run.core_count;
+        atomic_store_explicit(&run.go, ok ? 1 : -1, memory_order_release);
+        if (ok) {
+            multicore_worker(&run.cores[0]);
+        } else {
+            printf("Error: Unable to start a thread for each of the %d cores\n", run.core_count);
+        }
+        for (int c = 1; c < started; c++) {
+            pthread_join(threads[c], NULL);
         }
+        double elapsed = host_time() - start;
+        free(threads);
 
-        // Update pipeline registers
-        cpu->IFID.instruction = 0;  // Clear IFID register after decoding
-        cpu->IDEX.isempty = 0;      // Mark the IDEX register as full
+        long retired = 0;
+        for (int c = 0; ok && c < run.core_count; c++) {
+            MulticoreCore *core = &run.cores[c];
+            core->cpu->log_level = options->log_level;
+            core->cpu->host_seconds = elapsed;
+            retired += core->cpu->retired_count;
+            if (options->log_level < LOG_SUMMARY) continue;
+            printf("\nCore %d: %s\n", c, core->program_file);
+            if (core->budget_exhausted) {
+                printf("Cycle budget of %ld cycles exhausted, stopping the run\n", core->cpu->max_cycles);
+            }
+            End_program(core->cpu);
+            print_run_statistics(core->cpu);
+        }
+        if (ok && options->log_level >= LOG_SUMMARY) {
+            printf("\nMulti-core run: %d cores, %ld-cycle sync window, %ld windows\n", run.core_count, run.window, run.windows);
+            printf("Shared stores: %ld, %ld of them to a byte another core stored in the same window\n",
+                   run.shared_stores, run.conflicts);
+            printf("Host time: %.6f s\n", elapsed);
+            if (elapsed > 0) {
+                printf("Simulated MIPS (all cores): %.2f\n", retired / elapsed / 1e6);
+            }
+        }
+    }
 
-        // Print decoded instruction for debugging
-        printf("Decoded Instruction %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X\n", 
-               inst_num, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate);
+    for (int c = 0; c < run.core_count; c++) {
+        free(run.cores[c].cpu);
     }
+    free(run.cores);
+    return ok ? 0 : 1;
 }
 
-void erase_IDEX(CPU *cpu) {
-    // Reset all fields in the IDEX pipeline register
-    cpu->IDEX.opcode = 0;
-    cpu->IDEX.rd = 0;
-    cpu->IDEX.rs1 = 0;
-    cpu->IDEX.immediate = 0;
-    cpu->IDEX.inst_number = 0;
-    cpu->IDEX.isempty = 1;  // Mark the IDEX stage as empty
+static const BenchMode bench_modes[] = {
+    { "pipeline", false, false, true },
+    { "pipeline-eager", false, false, false },
+    { "functional", true, false, true },
+#ifdef JIT_SUPPORTED
+    { "jit", true, true, true },
+#endif
+};
+
+// Peak resident set size of the whole process so far
+long peak_rss_kib(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
 }
 
-void flush(CPU *cpu, uint8_t imm) {
-    printf("Flushing pipeline due to branch instruction with immediate value %d\n", imm);
-    uint16_t new_pc = cpu->registers[64] + (imm - 1);
-    if (new_pc >= 0) {
-        cpu->registers[64] = new_pc;
-    } else {
-        printf("Branch is cancelled due to negative PC\n");
-        return;
+// Workload name shown in reports and baselines: the file name without directory or extension
+static void bench_workload_name(const char *path, char *name) {
+    const char *base = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' || *p == '\\') base = p + 1;
     }
+    strcpy(name, base);
+    char *extension = strrchr(name, '.');
+    if (extension && extension != name) *extension = 0;
+}
 
-    // Flush both IFID and IDEX registers and branch to PC + Imm instruction if it exists
-    printf("Flushing IFID and IDEX registers\n");
-
-    // Flush IFID
-    printf("Flushing IFID: Instruction=0x%04X, Inst_Num=%d\n",
-           cpu->IFID.instruction, cpu->IFID.inst_number);
-    cpu->IFID.instruction = 0;  // Clear IFID register
-    cpu->IFID.inst_number = 0;
+// Baseline file: "workload mode ns_per_instruction" per line, # comments
+static BenchBaseline *read_bench_baseline(const char *filename, int *count) {
+    FILE *file = fopen(filename, "r");
+    *count = 0;
+    if (!file) {
+        printf("Error: Unable to open file %s\n", filename);
+        return NULL;
+    }
 
-    // Flush IDEX
-    printf("Flushing IDEX: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, Inst_Num=%d\n",
-           cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.inst_number);
-    erase_IDEX(cpu);
+    BenchBaseline *entries = NULL;
+    int capacity = 0;
+    char line[MAX_PATH_LENGTH + 64];
+    while (fgets(line, sizeof(line), file)) {
+        BenchBaseline entry;
+        line[strcspn(line, "#\r\n")] = 0;
+        if (sscanf(line, "%255s %31s %lf", entry.workload, entry.mode, &entry.ns_per_instruction) != 3) continue;
+        if (*count == capacity) {
+            capacity = capacity ? 2 * capacity : 32;
+            BenchBaseline *grown = realloc(entries, capacity * sizeof(BenchBaseline));
+            if (!grown) break;
+            entries = grown;
+        }
+        entries[(*count)++] = entry;
+    }
+    fclose(file);
+    return entries;
+}
 
-    if (cpu->registers[64] >= cpu->instruction_count) {
-        printf("Warning: Branch target out of bounds, PC=%d\n", cpu->registers[64]);
-    } else {
-        printf("Branching to instruction %d at PC=%d\n", cpu->registers[64] + 1, cpu->registers[64]);
+static const BenchBaseline *find_bench_baseline(const BenchBaseline *entries, int count, const char *workload, const char *mode) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].workload, workload) == 0 && strcmp(entries[i].mode, mode) == 0) return &entries[i];
     }
+    return NULL;
 }
 
-void flush_BR(CPU *cpu, uint16_t new_pc) {
-    if (new_pc < 0) {
-        printf("Branch is cancelled due to negative PC\n");
-        return;
+// Times every workload of the suite in every bench mode and compares host ns per simulated
+// instruction against the baseline. Returns nonzero when a workload fails to load or runs more
+// than tolerance percent slower than its baseline.
+int run_bench(const char *manifest_file, const RunOptions *options, const char *baseline_file, const char *save_file, double tolerance) {
+    FILE *manifest = fopen(manifest_file, "r");
+    if (!manifest) {
+        printf("Error: Unable to open file %s\n", manifest_file);
+        return 1;
     }
-    printf("Flushing pipeline due to BR instruction with new PC value %d\n", new_pc);
 
-    // Flush both IFID and IDEX registers and branch to new PC
-    printf("Flushing IFID and IDEX registers\n");
+    int baseline_count = 0;
+    BenchBaseline *baseline = baseline_file ? read_bench_baseline(baseline_file, &baseline_count) : NULL;
+    FILE *save = NULL;
+    if (save_file) {
+        save = fopen(save_file, "w");
+        if (!save) {
+            printf("Error: Unable to open file %s\n", save_file);
+        } else {
+            fprintf(save, "# workload mode ns_per_instruction with a budget of %ld; host specific, regenerate with --save-baseline\n", options->max_cycles);
+        }
+    }
 
-    // Flush IFID
-    printf("Flushing IFID: Instruction=0x%04X, Inst_Num=%d\n",
-           cpu->IFID.instruction, cpu->IFID.inst_number);
-    cpu->IFID.instruction = 0;  // Clear IFID register
-    cpu->IFID.inst_number = 0;
+    CPU *cpu = malloc(sizeof(CPU));
+    if (!cpu) {
+        printf("Error: Out of memory running %s\n", manifest_file);
+        fclose(manifest);
+        free(baseline);
+        if (save) fclose(save);
+        return 1;
+    }
 
-    // Flush IDEX
-    printf("Flushing IDEX: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X, Inst_Num=%d\n",
-           cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate, cpu->IDEX.inst_number);
-    erase_IDEX(cpu);
+    printf("%-16s %-15s %12s %12s %9s %11s %9s\n", "Workload", "Mode", "Retired", "Cycles", "ns/inst", "Mcycles/s", "Baseline");
+    int failures = 0, regressions = 0;
+    char line[MAX_PATH_LENGTH + 16];
+    while (fgets(line, sizeof(line), manifest)) {
+        char program[MAX_PATH_LENGTH], workload[MAX_PATH_LENGTH];
+        line[strcspn(line, "#\r\n")] = 0;
+        if (sscanf(line, "%255s", program) != 1) continue;
+        bench_workload_name(program, workload);
 
-    cpu->registers[64] = new_pc - 1;
+        for (size_t m = 0; m < sizeof(bench_modes) / sizeof(bench_modes[0]); m++) {
+            const BenchMode *mode = &bench_modes[m];
+            RunOptions run_options = *options;
+            run_options.log_level = LOG_SILENT;
+            run_options.functional = mode->functional;
+            run_options.jit = mode->jit;
+            run_options.lazy_flags = mode->lazy_flags;
+            run_options.checkpoint_every = 0;
+            run_options.counters_file = NULL;
+            run_options.trace_file = NULL;
+            run_options.pipeline_depth = 0; // Bench modes are the detailed and functional cores
+            run_options.out_of_order = false;
 
-    if (cpu->registers[64] >= cpu->instruction_count) {
-        printf("Warning: Branch target out of bounds, PC=%d\n", cpu->registers[64]);
-    } else {
-        printf("Branching to instruction %d at PC=%d\n", cpu->registers[64] + 1, cpu->registers[64]);
+            double best = 0;
+            bool ok = true;
+            for (int r = 0; r < BENCH_REPEATS && ok; r++) {
+                initialize_cpu(cpu);
+                apply_run_options(cpu, &run_options);
+                ok = load_program(cpu, program);
+                if (!ok) break;
+                run_cpu(cpu, &run_options);
+                if (r == 0 || cpu->host_seconds < best) best = cpu->host_seconds;
+            }
+            if (!ok) {
+                failures++;
+                break;
+            }
+
+            double ns_per_instruction = cpu->retired_count > 0 ? best * 1e9 / cpu->retired_count : 0;
+            printf("%-16s %-15s %12ld %12ld %9.2f ", workload, mode->name, cpu->retired_count, cpu->cycle_count, ns_per_instruction);
+            if (cpu->cycle_count > 0 && best > 0) {
+                printf("%11.2f ", cpu->cycle_count / best / 1e6);
+            } else {
+                printf("%11s ", "-");
+            }
+
+            const BenchBaseline *reference = find_bench_baseline(baseline, baseline_count, workload, mode->name);
+            if (!reference) {
+                printf("%9s\n", "-");
+            } else if (ns_per_instruction > reference->ns_per_instruction * (1 + tolerance / 100)) {
+                printf("%9.2f SLOWER by %.1f%%\n", reference->ns_per_instruction,
+                       100 * (ns_per_instruction / reference->ns_per_instruction - 1));
+                regressions++;
+            } else {
+                printf("%9.2f\n", reference->ns_per_instruction);
+            }
+            if (save) {
+                fprintf(save, "%s %s %.3f\n", workload, mode->name, ns_per_instruction);
+            }
+        }
+    }
+    printf("\nPeak RSS: %ld KiB\n", peak_rss_kib());
+    if (regressions > 0) {
+        printf("%d result(s) more than %.1f%% slower than %s\n", regressions, tolerance, baseline_file);
     }
+
+    fclose(manifest);
+    free(baseline);
+    free(cpu);
+    if (save) fclose(save);
+    return failures || regressions ? 1 : 0;
 }
 
-void update_status_register(CPU *cpu, int8_t result, uint8_t rd, uint8_t rs) {
-    uint8_t sreg = 0;
+// The lane helpers below are static and inlined, so the AVX argument-passing ABI note does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
 
-    // Carry Flag (C)
-    if (((int16_t)cpu->registers[rd] + (int16_t)cpu->registers[rs]) > 127 ||
-        ((int16_t)cpu->registers[rd] - (int16_t)cpu->registers[rs]) < -128) {
-        sreg |= CARRY_FLAG;
-    }
+static inline LaneVec lane_select(LaneVec mask, LaneVec a, LaneVec b) {
+    return (a & mask) | (b & ~mask);
+}
 
-    // Two's Complement Overflow Flag (V)
-    int8_t signed_rd = cpu->registers[rd];
-    int8_t signed_rs = cpu->registers[rs];
-    if (((signed_rd > 0) && (signed_rs > 0) && (result < 0)) || 
-        ((signed_rd < 0) && (signed_rs < 0) && (result > 0))) {
-        sreg |= OVERFLOW_FLAG;
+static inline LaneVec lane_splat(int8_t value) {
+    return (LaneVec){0} + value;
+}
+
+static inline bool lanes_any(LaneVec lanes) {
+    typedef uint64_t LaneWords __attribute__((vector_size(LOCKSTEP_LANES)));
+    LaneWords words = (LaneWords)lanes;
+    uint64_t any = 0;
+    for (int i = 0; i < LOCKSTEP_LANES / 8; i++) {
+        any |= words[i];
     }
+    return any != 0;
+}
 
-    // Negative Flag (N)
-    if (result < 0) {
-        sreg |= NEGATIVE_FLAG;
+static void lockstep_count(long *counters, LaneVec lanes, long amount) {
+    for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+        if (lanes[lane]) counters[lane] += amount;
     }
+}
 
-    // Zero Flag (Z)
-    if (result == 0) {
-        sreg |= ZERO_FLAG;
+static void lockstep_jump(LockstepGroup *group, LaneVec lanes, int next) {
+    LanePcVec wide = __builtin_convertvector(lanes, LanePcVec);
+    group->pc = (group->pc & ~wide) | (((LanePcVec){0} + (int16_t)next) & wide);
+}
+
+static void lockstep_stop(LockstepGroup *group, LaneVec lanes, LaneVec pc_register) {
+    group->pc_register = lane_select(lanes, pc_register, group->pc_register);
+    group->active &= ~lanes;
+}
+
+// Taken branches either continue at an instruction or leave the program, like uop_jump()
+static void lockstep_branch(LockstepGroup *group, const CPU *program, LaneVec lanes, int8_t pc_register) {
+    if (pc_register >= 0 && pc_register < program->instruction_count) {
+        group->pc_register = lane_select(lanes, lane_splat(pc_register), group->pc_register);
+        lockstep_jump(group, lanes, pc_register);
+    } else {
+        lockstep_stop(group, lanes, lane_splat(pc_register));
     }
+}
 
-    // Sign Flag (S) = N ⊕ V
-    if (((sreg & NEGATIVE_FLAG) >> 2) ^ ((sreg & OVERFLOW_FLAG) >> 1)) {
-        sreg |= SIGN_FLAG;
+static inline void lockstep_write(LockstepGroup *group, LaneVec mask, uint8_t rd, LaneVec result, uint8_t rs) {
+    group->registers[rd] = lane_select(mask, result, group->registers[rd]);
+    group->flags_result = lane_select(mask, result, group->flags_result);
+    group->flags_rs = lane_select(mask, group->registers[rs], group->flags_rs);
+    group->flags_pending |= mask;
+}
+
+// Execute micro-op `index` on the lanes in `mask`; mirrors the uop_* handlers lane by lane
+static void lockstep_execute(LockstepGroup *group, const CPU *program, int index, LaneVec mask) {
+    const MicroOp *op = &program->uops[index];
+    LaneVec *regs = group->registers;
+    uint8_t rd = op->rd, rs = op->rs1;
+    int shift = op->immediate & 31; // Host shifts by 32..63 use the count modulo 32
+
+    lockstep_count(group->dispatched, mask, 1);
+    if (index >= program->instruction_count) {
+        lockstep_stop(group, mask, lane_splat(program->instruction_count));
+        return;
+    }
+    if (op->handler == uop_nop || op->handler == uop_invalid) {
+        lockstep_jump(group, mask, index + 1);
+        return;
     }
+    lockstep_count(group->retired, mask, 1);
 
-    cpu->registers[65] = sreg; // Update SREG
+    switch (op->opcode) {
+        case 0x00: // ADD
+            lockstep_write(group, mask, rd, (LaneVec)((LaneUVec)regs[rd] + (LaneUVec)regs[rs]), rs);
+            break;
+        case 0x01: // SUB
+            lockstep_write(group, mask, rd, (LaneVec)((LaneUVec)regs[rd] - (LaneUVec)regs[rs]), rs);
+            break;
+        case 0x02: // MUL
+            lockstep_write(group, mask, rd, (LaneVec)((LaneUVec)regs[rd] * (LaneUVec)regs[rs]), rs);
+            break;
+        case 0x03: // MOVI
+            lockstep_write(group, mask, rd, lane_splat(op->immediate), 0);
+            break;
+        case 0x04: { // BEQZ
+            LaneVec taken = (regs[rd] == 0) & mask;
+            uint8_t imm = op->immediate;
+            uint16_t new_pc = pipeline_pc_after(program, op) + (imm - 1);
+            lockstep_branch(group, program, taken, (int8_t)new_pc);
+            lockstep_jump(group, mask & ~taken, index + 1);
+            return;
+        }
+        case 0x05: // ANDI
+            lockstep_write(group, mask, rd, regs[rd] & op->immediate, 0);
+            break;
+        case 0x06: // EOR
+            lockstep_write(group, mask, rd, regs[rd] ^ regs[rs], rs);
+            break;
+        case 0x07: // BR: targets come from register values, so each lane resolves its own
+            for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+                if (!mask[lane]) continue;
+                LaneVec one = (LaneVec){0};
+                one[lane] = -1;
+                uint16_t concat_value = ((uint16_t)regs[rd][lane] << 8) | regs[rs][lane];
+                uint16_t new_pc = concat_value >> 6;
+                lockstep_branch(group, program, one, (int8_t)(new_pc - 1));
+            }
+            return;
+        case 0x08: // SAL
+            lockstep_write(group, mask, rd, shift >= 8 ? lane_splat(0) : (LaneVec)((LaneUVec)regs[rd] << shift), 0);
+            break;
+        case 0x09: // SAR
+            lockstep_write(group, mask, rd, regs[rd] >> (shift >= 8 ? 7 : shift), 0);
+            break;
+        case 0x0A: // LDR
+            lockstep_write(group, mask, rd, group->data_memory[op->immediate], 0);
+            break;
+        case 0x0B: // STR
+            group->data_memory[op->immediate] = lane_select(mask, regs[rd], group->data_memory[op->immediate]);
+            break;
+        case HALT_OPCODE:
+            lockstep_stop(group, mask, lane_splat(pipeline_pc_after(program, op)));
+            return;
+    }
+    lockstep_jump(group, mask, index + 1);
 }
 
-void execute(CPU *cpu) {
-    if (cpu->IDEX.isempty == 0 && cpu->stall_flag == 0) {
-        uint8_t opcode = cpu->IDEX.opcode;
-        uint8_t rd = cpu->IDEX.rd;
-        uint8_t rs = cpu->IDEX.rs1;
-        int8_t imm = cpu->IDEX.immediate;
-        int8_t result = 0;
+// Fast path for a set of lanes that share one PC: straight-line code and branches every lane takes
+// the same way run without per-lane bookkeeping, until the PC reaches `stop_at` (where other lanes are
+// waiting to rejoin). Returns the micro-op it stopped at; *blocked is set if lockstep_execute() has to
+// run that micro-op, and cleared if a lane's budget ran out or the lanes caught up with others.
+static inline int lockstep_run_lanes(LockstepGroup *group, const CPU *program, LaneVec lanes, int index, int stop_at,
+                              long max_steps, bool *blocked) {
+    LaneVec *regs = group->registers;
+    long limit = LONG_MAX;
+    long steps = 0, retired = 0;
 
-        switch (opcode) {
+    if (max_steps > 0) {
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            if (lanes[lane] && max_steps - group->dispatched[lane] < limit) limit = max_steps - group->dispatched[lane];
+        }
+    }
+
+    *blocked = false;
+    while (index < stop_at && steps < limit) {
+        const MicroOp *op = &program->uops[index];
+        uint8_t rd = op->rd, rs = op->rs1;
+        int shift = op->immediate & 31;
+
+        if (index >= program->instruction_count) {
+            *blocked = true;
+            break;
+        }
+        if (op->handler == uop_nop || op->handler == uop_invalid) {
+            index++;
+            steps++;
+            continue;
+        }
+
+        switch (op->opcode) {
             case 0x00: // ADD
-                result = cpu->registers[rd] + cpu->registers[rs];
-                cpu->registers[rd] = result;
-                update_status_register(cpu, result, rd, rs);
+                lockstep_write(group, lanes, rd, (LaneVec)((LaneUVec)regs[rd] + (LaneUVec)regs[rs]), rs);
                 break;
             case 0x01: // SUB
-                result = cpu->registers[rd] - cpu->registers[rs];
-                cpu->registers[rd] = result;
-                update_status_register(cpu, result, rd, rs);
+                lockstep_write(group, lanes, rd, (LaneVec)((LaneUVec)regs[rd] - (LaneUVec)regs[rs]), rs);
                 break;
             case 0x02: // MUL
-                result = cpu->registers[rd] * cpu->registers[rs];
-                cpu->registers[rd] = result;
-                update_status_register(cpu, result, rd, rs);
+                lockstep_write(group, lanes, rd, (LaneVec)((LaneUVec)regs[rd] * (LaneUVec)regs[rs]), rs);
                 break;
             case 0x03: // MOVI
-                cpu->registers[rd] = imm;  // Store signed value directly
-                update_status_register(cpu, imm, rd, 0);
+                lockstep_write(group, lanes, rd, lane_splat(op->immediate), 0);
                 break;
-            case 0x04: // BEQZ
-                if (cpu->registers[rd] == 0) {
-                    printf("@PC=%d  BEQZ to %d: Branch Taken because R%d = %d\n", cpu->registers[64], imm, rd, cpu->registers[rd]);
-                    flush(cpu, imm);  // Call flush function for branch
-                } else {
-                    printf("BEQZ to %d: Branch Not Taken because R%d = %d\n", imm, rd, cpu->registers[rd]);
+            case 0x04: { // BEQZ
+                LaneVec taken = (regs[rd] == 0) & lanes;
+                if (!lanes_any(taken)) break;
+                uint8_t imm = op->immediate;
+                int8_t target = (uint16_t)(pipeline_pc_after(program, op) + (imm - 1));
+                if (lanes_any(taken ^ lanes) || target < 0 || target >= program->instruction_count) {
+                    *blocked = true;
+                    goto done;
                 }
-                break;
+                group->pc_register = lane_select(lanes, lane_splat(target), group->pc_register);
+                index = target;
+                steps++;
+                retired++;
+                continue;
+            }
             case 0x05: // ANDI
-                if (imm >= 0 && imm <= 63) {
-                    result = cpu->registers[rd] & imm;
-                    cpu->registers[rd] = result;
-                    update_status_register(cpu, result, rd, 0);
-                } else {
-                    printf("Error: ANDI executed with invalid immediate value %d (valid range is 0-63)\n", imm);
-                }
+                lockstep_write(group, lanes, rd, regs[rd] & op->immediate, 0);
                 break;
             case 0x06: // EOR
-                result = cpu->registers[rd] ^ cpu->registers[rs];
-                cpu->registers[rd] = result;
-                update_status_register(cpu, result, rd, rs);
-                break;
-            case 0x07: { // BR
-                // Concatenate R1 and R2 and take the first 10 bits
-                uint16_t concat_value = ((uint16_t)cpu->registers[rd] << 8) | cpu->registers[rs];
-                uint16_t new_pc = concat_value >> 6;
-                flush_BR(cpu, new_pc);
+                lockstep_write(group, lanes, rd, regs[rd] ^ regs[rs], rs);
                 break;
-            }
             case 0x08: // SAL
-                if (imm >= 0 && imm <= 63) {
-                    result = cpu->registers[rd] << imm;
-                    cpu->registers[rd] = result;
-                    update_status_register(cpu, result, rd, 0);
-                } else {
-                    printf("Error: SAL executed with invalid immediate value %d (valid range is 0-63)\n", imm);
-                }
+                lockstep_write(group, lanes, rd, shift >= 8 ? lane_splat(0) : (LaneVec)((LaneUVec)regs[rd] << shift), 0);
                 break;
             case 0x09: // SAR
-                if (imm >= 0 && imm <= 63) {
-                    result = cpu->registers[rd] >> imm;
-                    cpu->registers[rd] = result;
-                    update_status_register(cpu, result, rd, 0);
-                } else {
-                    printf("Error: SAR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
-                }
+                lockstep_write(group, lanes, rd, regs[rd] >> (shift >= 8 ? 7 : shift), 0);
                 break;
             case 0x0A: // LDR
-                if (imm >= 0 && imm <= 63) {
-                    result = cpu->data_memory[imm];
-                    cpu->registers[rd] = result;
-                    update_status_register(cpu, result, rd, 0);
-                } else {
-                    printf("Error: LDR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
-                }
+                lockstep_write(group, lanes, rd, group->data_memory[op->immediate], 0);
                 break;
             case 0x0B: // STR
-                if (imm >= 0 && imm <= 63) {
-                    cpu->data_memory[imm] = cpu->registers[rd];
-                } else {
-                    printf("Error: STR executed with invalid immediate value %d (valid range is 0-63)\n", imm);
-                }
-                break;
-            default:
-                printf("Error: Unknown opcode 0x%X\n", opcode);
+                group->data_memory[op->immediate] = lane_select(lanes, regs[rd], group->data_memory[op->immediate]);
                 break;
+            default: // BR and HALT
+                *blocked = true;
+                goto done;
         }
+        index++;
+        steps++;
+        retired++;
+    }
 
-        cpu->IDEX.isempty = 1;
-        if (cpu->stall_flag != 1) {
-            printf("Executed Instruction %d: Opcode=0x%X, RD=%d, RS1=%d, Immediate=0x%X\n",
-                   cpu->IDEX.inst_number, cpu->IDEX.opcode, cpu->IDEX.rd, cpu->IDEX.rs1, cpu->IDEX.immediate);
+done:
+    lockstep_count(group->dispatched, lanes, steps);
+    lockstep_count(group->retired, lanes, retired);
+    return index;
+}
+
+static void lockstep_run_group(LockstepGroup *group, const CPU *program, long max_steps) {
+    while (lanes_any(group->active)) {
+        // Each lane has the same instruction budget as a functional run; exhausted lanes just stop
+        LaneVec exhausted = (LaneVec){0};
+        int lowest = INT16_MAX, second = INT16_MAX;
+        for (int lane = 0; lane < LOCKSTEP_LANES; lane++) {
+            if (!group->active[lane]) continue;
+            if (max_steps > 0 && group->dispatched[lane] >= max_steps) {
+                exhausted[lane] = -1;
+            } else if (group->pc[lane] < lowest) {
+                second = lowest;
+                lowest = group->pc[lane];
+            } else if (group->pc[lane] > lowest && group->pc[lane] < second) {
+                second = group->pc[lane];
+            }
+        }
+        group->active &= ~exhausted;
+        if (lowest == INT16_MAX) continue;
+
+        // Run the lanes at the lowest PC until they reach the next waiting lanes, so lanes that
+        // branched around code rejoin as soon as the others get there
+        LaneVec lanes = __builtin_convertvector(group->pc == (int16_t)lowest, LaneVec) & group->active;
+        bool blocked;
+        int index = lockstep_run_lanes(group, program, lanes, lowest, second, max_steps, &blocked);
+        lockstep_jump(group, lanes, index);
+        if (blocked) {
+            lockstep_execute(group, program, index, lanes);
+        }
+    }
+}
+
+// Transpose one instance's initial registers, SREG and data memory into a lane and start it
+static void lockstep_seed_lane(LockstepGroup *group, int lane, const CPU *cpu) {
+    for (int i = 0; i < 64; i++) {
+        group->registers[i][lane] = cpu->registers[i];
+    }
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+        group->data_memory[i][lane] = cpu->data_memory[i];
+    }
+    group->sreg[lane] = cpu->registers[65];
+    group->active[lane] = -1;
+}
+
+// Architectural state of a finished lane: registers 0-65 and data memory
+static void lockstep_read_lane(const LockstepGroup *group, int lane, int8_t *registers, uint8_t *data_memory) {
+    for (int i = 0; i < 64; i++) {
+        registers[i] = group->registers[i][lane];
+    }
+    registers[64] = group->pc_register[lane];
+    registers[65] = group->flags_pending[lane]
+        ? compute_status_register(group->flags_result[lane], group->flags_result[lane], group->flags_rs[lane])
+        : group->sreg[lane];
+    for (int i = 0; i < DATA_MEMORY_SIZE; i++) {
+        data_memory[i] = group->data_memory[i][lane];
+    }
+}
+
+// Runs cpu's state through a single lane of the engine and writes the result back, so callers can
+// check the lockstep engine against the other cores
+void run_lockstep_lane(LockstepGroup *group, const CPU *program, CPU *cpu, long max_steps) {
+    memset(group, 0, sizeof(*group));
+    lockstep_seed_lane(group, 0, cpu);
+    lockstep_run_group(group, program, max_steps);
+    lockstep_read_lane(group, 0, cpu->registers, cpu->data_memory);
+    cpu->flags.pending = false;
+    cpu->retired_count = group->retired[0];
+}
+
+void *lockstep_alloc(size_t size) {
+#ifdef _WIN32
+    return _aligned_malloc(size, 64);
+#else
+    return aligned_alloc(64, (size + 63) & ~(size_t)63);
+#endif
+}
+
+void lockstep_free(void *memory) {
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// Manifest format: one data image per line (see load_data_image); each one becomes a lane running program_file
+int run_lockstep(const char *program_file, const char *manifest_file, const RunOptions *options, const char *report_file) {
+    CPU *program = malloc(sizeof(CPU));
+    CPU *lane_cpu = malloc(sizeof(CPU));
+    LockstepGroup *group = lockstep_alloc(sizeof(LockstepGroup));
+    FILE *manifest = fopen(manifest_file, "r");
+    if (!program || !lane_cpu || !group || !manifest) {
+        printf("Error: Unable to start lockstep run from %s\n", manifest_file);
+        if (manifest) fclose(manifest);
+        free(program);
+        free(lane_cpu);
+        lockstep_free(group);
+        return 1;
+    }
+
+    initialize_cpu(program);
+    program->log_level = LOG_SILENT;
+    bool loaded = load_program(program, program_file);
+
+    BatchJob *jobs = NULL;
+    int job_count = 0, job_capacity = 0;
+    char line[MAX_PATH_LENGTH + 16];
+    while (loaded && fgets(line, sizeof(line), manifest)) {
+        char data[MAX_PATH_LENGTH];
+        line[strcspn(line, "#\r\n")] = 0;
+        if (sscanf(line, "%255s", data) != 1) continue;
+
+        if (job_count == job_capacity) {
+            job_capacity = job_capacity ? 2 * job_capacity : 64;
+            BatchJob *grown = realloc(jobs, job_capacity * sizeof(BatchJob));
+            if (!grown) break;
+            jobs = grown;
+        }
+        BatchJob *job = &jobs[job_count++];
+        memset(job, 0, sizeof(*job));
+        strncpy(job->program_file, program_file, MAX_PATH_LENGTH - 1);
+        strcpy(job->data_file, data);
+    }
+    fclose(manifest);
+
+    double start = host_time();
+    for (int first = 0; first < job_count; first += LOCKSTEP_LANES) {
+        int lanes = job_count - first < LOCKSTEP_LANES ? job_count - first : LOCKSTEP_LANES;
+
+        // Transpose each lane's initial state into the struct-of-arrays group
+        memset(group, 0, sizeof(*group));
+        for (int lane = 0; lane < lanes; lane++) {
+            BatchJob *job = &jobs[first + lane];
+            // Start from the program's own initial state (.data, image data section), as a batch run does
+            initialize_cpu(lane_cpu);
+            memcpy(lane_cpu->registers, program->registers, sizeof(lane_cpu->registers));
+            memcpy(lane_cpu->data_memory, program->data_memory, sizeof(lane_cpu->data_memory));
+            job->ok = load_data_image(lane_cpu, job->data_file);
+            if (!job->ok) continue;
+            lockstep_seed_lane(group, lane, lane_cpu);
         }
+
+        lockstep_run_group(group, program, options->max_cycles);
+
+        for (int lane = 0; lane < lanes; lane++) {
+            BatchJob *job = &jobs[first + lane];
+            if (!job->ok) continue;
+            lockstep_read_lane(group, lane, job->registers, job->data_memory);
+            job->retired = group->retired[lane];
+        }
+    }
+    double elapsed = host_time() - start;
+
+    FILE *out = report_file ? fopen(report_file, "w") : stdout;
+    if (!out) {
+        printf("Error: Unable to open file %s\n", report_file);
+        out = stdout;
+    }
+    write_batch_report(out, jobs, job_count, 1, elapsed);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    int failures = loaded ? 0 : 1;
+    for (int j = 0; j < job_count; j++) {
+        if (!jobs[j].ok) failures++;
     }
+    free(jobs);
+    lockstep_free(group);
+    free(lane_cpu);
+    free(program);
+    return failures ? 1 : 0;
 }
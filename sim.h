@@ -0,0 +1,47 @@
+// C API of the simulator for host programs that drive it in-process.
+// Build main.c with -DCA_SIM_LIBRARY to leave out main() and link it with the host program.
+// A CPU created here runs the detailed pipeline with the command-line defaults and prints nothing.
+#ifndef CA_SIM_H
+#define CA_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct CPU CPU;
+
+// Optional callbacks; NULL members are skipped. Hook sites exist only in library builds, so the
+// command-line simulator pays nothing for them.
+typedef struct {
+    void (*on_retire)(void *context, CPU *cpu, int pc, uint16_t instruction);
+    void (*on_flush)(void *context, CPU *cpu, int target_pc);  // Fetched instructions were squashed
+    void (*on_memory)(void *context, CPU *cpu, int pc, int address, uint8_t value, bool write);
+    void *context;
+} SimHooks;
+
+CPU *sim_create(void);
+void sim_destroy(CPU *cpu);
+
+// Assembler source or a program image (--assemble output), replacing the CPU's program and state.
+// Returns false, with the errors printed on stdout, if any line fails to assemble or the image is
+// malformed; the CPU is then left empty and finished.
+bool sim_load_program(CPU *cpu, const void *buffer, size_t size);
+
+// Run up to `cycles` clock cycles; returns how many ran, fewer once the program has finished
+long sim_step(CPU *cpu, long cycles);
+// Run until the cycle count reaches `cycle`, or until the instruction at `pc` is the next to execute
+// (pass -1 to leave either out). Returns the cycles that ran.
+long sim_run_until(CPU *cpu, long cycle, int pc);
+bool sim_finished(const CPU *cpu);
+long sim_cycles(const CPU *cpu);
+long sim_retired(const CPU *cpu);
+
+// Registers 0-63, 64 (PC) and 65 (SREG); data memory bytes 0-2047
+int8_t sim_read_register(CPU *cpu, int reg);
+void sim_write_register(CPU *cpu, int reg, int8_t value);
+uint8_t sim_read_memory(const CPU *cpu, int address);
+void sim_write_memory(CPU *cpu, int address, uint8_t value);
+
+void sim_set_hooks(CPU *cpu, const SimHooks *hooks);
+
+#endif